@@ -5,9 +5,73 @@
  * results into a circular buffer. Conversions are triggered
  * from the Timer0 CMPA signal.
  *
+ * Oversampling mode:
+ *   Where an oversampling ratio (OSR) of 4 or 8 is selected, conversions
+ *   are instead triggered by Timer1 overflow at OSR x 15.625 kHz and the
+ *   full 10-bit result is passed through a second order CIC (sinc^2)
+ *   decimator. Only every OSR-th (decimated) sample is queued into the
+ *   buffer, so the output rate and SD bandwidth are unchanged. The sinc^2
+ *   response places nulls at multiples of 15.625 kHz, attenuating the
+ *   components that would otherwise alias into the audio band, and the
+ *   averaging of OSR conversions lowers the quantisation/noise floor
+ *   (~1 bit per 4x). The decimated value is rounded to 8 bits.
+ *
+ *   The CIC is implemented with 16-bit wraparound arithmetic: two adds per
+ *   conversion (integrators) and two subtracts per output (combs). The
+ *   gain of OSR^2 gives a 14-bit (OSR 4) or 16-bit (OSR 8) result.
+ *
+ *   OSR   Trigger    ADC clock   Conversion   CPU cycles/conversion
+ *    4    62.5 kHz   1 MHz       13.5 us      256
+ *    8    125 kHz    2 MHz       6.75 us      128
+ *
+ *   ADC clocks above 200 kHz reduce the per-conversion accuracy of the
+ *   ADC; the resolution gained from oversampling comes from averaging.
+ *   An OSR of 16 is not supported: at 64 CPU cycles per conversion the
+ *   ISR (register save/restore alone is ~40 cycles) would starve the
+ *   main loop. Timer1 is shared with playback (PWM), which is never
+ *   active while recording.
+ *
+ * Record DSP:
+ *   Where any DSP stage is enabled (dsp_config), each sample is passed to
+ *   the DSP module at 16-bit precision (the full 10-bit conversion, or the
+ *   full CIC output) and the processed 8-bit sample is queued instead.
+ *
+ * Multi-channel (stereo) mode:
+ *   Where two channels are selected (adc_channels), the ADC mux alternates
+ *   between ADC0 (PF0) and ADC1 (PF1) on successive Timer0 triggers, and
+ *   samples are queued interleaved as WAVE frames (left, right). The frame
+ *   rate is half the trigger rate (7.8125 kHz), so the data rate and page
+ *   timing are unchanged. The mux for the next conversion is written in
+ *   the ISR, which must run before the next trigger: the ADC clock is
+ *   raised to 500 kHz (27 us conversion), leaving ~37 us (590 cycles) of
+ *   the 64 us trigger period. Oversampling and the record DSP chain are
+ *   not applied in this mode (per channel state would be required).
+ *
+ *   Inter-channel skew: ADC1 is converted one trigger period (64 us, half
+ *   a frame) after ADC0. Both channels are linearly interpolated to the
+ *   common instant midway between them (32 us before each ADC0 sample):
+ *
+ *     left[n]  = (3 * adc0[n] + adc0[n-1]) / 4
+ *     right[n] = (3 * adc1[n-1] + adc1[n]) / 4
+ *
+ *   Both channels have the same (mild low-pass) response, |0.75 + 0.25z^-1|,
+ *   -2 dB at 1.95 kHz and -6 dB at 3.9 kHz (Nyquist), so the channels stay
+ *   balanced and in phase. The output is delayed by 32 us relative to the
+ *   triggers.
+ *
+ * Clip detection:
+ *   Every conversion at an ADC rail (0x00/0xFF in ADCH where only 8 bits are
+ *   used, or 0/1023 where the full 10-bit result is used) increments the
+ *   clip counter of the level meter. The test is a single add and compare
+ *   (rail values map to 0 and 1 after adding one), so costs a constant
+ *   ~5 cycles per conversion.
+ *
  * Requires:
  *   timer	- Configures Timer0 to trigger ADC conversions. 
  *   buffer - Circular buffer (queue) used to store audio samples.
+ *   dsp - Record DSP chain (optional processing of samples).
+ *   meter - Level meter, measures each sample queued into the buffer
+ *           and counts clipped conversions.
  *
  * Version: v1.0
  *    Date: 10/04/2016
@@ -22,6 +86,25 @@
 #include <avr/interrupt.h>
 
 #include "buffer.h"
+#include "dsp.h"
+#include "meter.h"
+#include "adc.h"
+
+/************************************************************************/
+/* GLOBAL VARIABLES                                                     */
+/************************************************************************/
+uint8_t adc_osr = 1;		// Oversampling ratio (1 = oversampling disabled)
+uint8_t adc_shift = 0;		// Left shift to scale decimator output to 16 bits
+
+uint8_t adc_nch = 1;		// Number of channels (1 = mono, ADC0 only)
+uint8_t adc_ch;				// Channel of conversion in progress (multi-channel)
+uint8_t adc_prev[2];		// Previous conversion of each channel (skew interpolation)
+
+uint8_t cic_count;			// Conversions remaining until next output sample
+uint16_t cic_int1;			// CIC integrator stage 1
+uint16_t cic_int2;			// CIC integrator stage 2
+uint16_t cic_comb1;			// CIC comb stage 1 delay
+uint16_t cic_comb2;			// CIC comb stage 2 delay
 
 /************************************************************************/
 /* PUBLIC/USER FUNCTIONS                                                */
@@ -32,13 +115,103 @@ void adc_init() {
 }
 
 void adc_start() {
-	ADCSRA = 0xAE;	// /64 prescaler (250 kHz clock), enable interrupts, ADC enable
+	if (adc_nch > 1) {
+		adc_ch = 0;
+		adc_prev[0] = 0x80;
+		adc_prev[1] = 0x80;
+		
+		ADMUX = 0x60;	// Left adjust result, AREF = AVCC, ADC0 first
+		ADCSRB = 0x03;	// Select Timer0 CMPA as trigger
+		ADCSRA = 0xAD;	// /32 prescaler (500 kHz clock), enable interrupts, ADC enable
+	} else if (adc_osr == 1) {
+		ADMUX = 0x60;	// Left adjust result, AREF = AVCC
+		ADCSRB = 0x03;	// Select Timer0 CMPA as trigger
+		ADCSRA = 0xAE;	// /64 prescaler (250 kHz clock), enable interrupts, ADC enable
+	} else {
+		// Reset decimator state
+		cic_count = adc_osr;
+		cic_int1 = 0;
+		cic_int2 = 0;
+		cic_comb1 = 0;
+		cic_comb2 = 0;
+		
+		ADMUX = 0x40;	// Right adjust result (10-bit), AREF = AVCC
+		ADCSRB = 0x06;	// Select Timer1 overflow as trigger
+		
+		// Timer1 Fast PWM (TOP = OCR1A), no outputs, /1 prescaler
+		TCCR1A = 0x03;
+		TCCR1B = 0x00;
+		TCNT1 = 0;
+		OCR1A = (1024 / adc_osr) - 1;	// OSR x 15.625 kHz
+		TIFR1 = (1<<TOV1);
+		TCCR1B = 0x19;
+		
+		if (adc_osr == 4) {
+			ADCSRA = 0xAC;	// /16 prescaler (1 MHz clock), enable interrupts, ADC enable
+		} else {
+			ADCSRA = 0xAB;	// /8 prescaler (2 MHz clock), enable interrupts, ADC enable
+		}
+	}
 }
 
 void adc_stop() {
 	ADCSRA = 0x00;
+	
+	if (adc_osr != 1) {
+		TCCR1B = 0x00;	// Stop Timer1 (oversampling trigger)
+		TCCR1A = 0x00;
+	}
 }
 
+/**
+ * Function: adc_oversample
+ * 
+ * Selects the oversampling ratio used by subsequent calls to adc_start.
+ * Must not be called while the ADC is running.
+ *
+ * Parameters:
+ *    ratio - Oversampling ratio: 1 (disabled), 4 or 8. Other values
+ *            disable oversampling.
+ *
+ * Returns: The oversampling ratio selected.
+ */
+uint8_t adc_oversample(uint8_t ratio) {
+	switch (ratio) {
+		case 4:
+			adc_shift = 2;	// 14-bit CIC output
+			break;
+		case 8:
+			adc_shift = 0;	// 16-bit CIC output
+			break;
+		default:
+			ratio = 1;
+			adc_shift = 0;
+			break;
+	}
+	adc_osr = ratio;
+	
+	return adc_osr;
+}
+
+/**
+ * Function: adc_channels
+ * 
+ * Selects the number of channels recorded by subsequent calls to adc_start.
+ * Must not be called while the ADC is running.
+ *
+ * Parameters:
+ *    count - Number of channels: 1 (mono, ADC0) or 2 (stereo, ADC0 and
+ *            ADC1). Other values select mono.
+ *
+ * Returns: The number of channels selected.
+ */
+uint8_t adc_channels(uint8_t count) {
+	adc_nch = (count == 2) ? 2 : 1;
+	
+	return adc_nch;
+}
+
+
 /************************************************************************/
 /* INTERRUPT SERVICE ROUTINES                                           */
 /************************************************************************/
@@ -49,6 +222,72 @@ void adc_stop() {
  * Interrupt service routine which executes on completion of ADC conversion.
  */
 ISR(ADC_vect) {
-	uint8_t result = ADCH;	//Read result
+	uint16_t x;
+	uint16_t y;
+	uint8_t result;
+	uint8_t prev;
+	
+	if (adc_nch > 1) {
+		result = ADCH;	//Read result
+		if ((uint8_t)(result + 1) <= 1) meter_clips++;	// 0x00 or 0xFF
+		
+		// Select channel of next conversion (before next trigger)
+		ADMUX = 0x60 | (adc_ch ^ 1);
+		
+		// Interpolate to instant between channels (see skew, above)
+		prev = adc_prev[adc_ch];
+		adc_prev[adc_ch] = result;
+		if (adc_ch) {
+			result = (uint8_t)((3 * (uint16_t)prev + result + 2) >> 2);
+		} else {
+			result = (uint8_t)((3 * (uint16_t)result + prev + 2) >> 2);
+		}
+		adc_ch ^= 1;
+		goto store;
+	}
+	
+	if (adc_osr == 1) {
+		if (!dsp_flags) {
+			result = ADCH;	//Read result
+			if ((uint8_t)(result + 1) <= 1) meter_clips++;	// 0x00 or 0xFF
+			goto store;
+		}
+		y = ADC;	// Left adjusted, 16-bit scale
+		if ((((y >> 6) + 1) & 0x3FF) <= 1) meter_clips++;	// 0 or 1023
+	} else {
+		// Clear Timer1 overflow flag (no Timer1 ISR), else the next
+		// overflow does not generate a new trigger edge
+		TIFR1 = (1<<TOV1);
+		
+		x = ADC;
+		if (((x + 1) & 0x3FF) <= 1) meter_clips++;	// 0 or 1023
+		
+		// Integrators (run at conversion rate)
+		cic_int1 += x;
+		cic_int2 += cic_int1;
+		
+		if (--cic_count) return;
+		cic_count = adc_osr;
+		
+		// Combs (run at output rate)
+		x = cic_int2 - cic_comb1;
+		cic_comb1 = cic_int2;
+		y = x - cic_comb2;
+		cic_comb2 = x;
+		y <<= adc_shift;	// Scale to 16 bits
+		
+		if (!dsp_flags) {
+			// Round to 8 bits (saturating at full scale)
+			y = ((y >> 7) + 1) >> 1;
+			result = (y > 0xFF) ? 0xFF : y;
+			goto store;
+		}
+	}
+	
+	// Offset binary to two's complement (Q15) and process
+	result = dsp_process((int16_t)(y ^ 0x8000));
+	
+store:
+	meter_sample(result);	//Update level measurements
 	buffer_queue(result);	//Store result into buffer
-}
\ No newline at end of file
+}
@@ -10,8 +10,13 @@
 #ifndef ADC_H_
 #define ADC_H_
 
+extern uint8_t adc_osr;	// Oversampling ratio in use (1 = disabled)
+extern uint8_t adc_nch;	// Number of channels recorded (interleaved)
+
 void adc_init();	// Initialises ADC
 void adc_start();	// Enables ADC to start conversions (triggered by Timer0 CMPA)
 void adc_stop();	// Disables ADC conversions
+uint8_t adc_oversample(uint8_t ratio);	// Selects oversampling ratio (1, 4 or 8)
+uint8_t adc_channels(uint8_t count);	// Selects number of channels (1 or 2, interleaved)
 
 #endif /* ADC_H_ */
\ No newline at end of file
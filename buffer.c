@@ -173,4 +173,17 @@ uint8_t* buffer_writePage() {
 	}
 	
 	return page;
-}
\ No newline at end of file
+}
+
+/**
+ * Function: buffer_writeIndex
+ * 
+ * Returns the number of samples queued in the current (partially filled)
+ * page. Must be called with interrupts disabled where samples are being
+ * queued from an ISR.
+ *
+ * Returns: Offset of the write pointer within its page (0-511)
+ */
+uint16_t buffer_writeIndex() {
+	return (uint16_t)(pHead - samples) & 511;
+}
@@ -22,5 +22,6 @@ void buffer_queue(uint8_t word);	// Writes a sample to the buffer and advances t
 uint8_t buffer_dequeue();			// Reads a sample from the buffer and advances the read pointer
 uint8_t* buffer_readPage();			// Allows user code to read a full page from the buffer
 uint8_t* buffer_writePage();		// Allows user code to write a full page to the buffer
+uint16_t buffer_writeIndex();		// Returns offset of the write pointer within its page
 
 #endif /* BUFFER_H_ */
\ No newline at end of file
@@ -0,0 +1,332 @@
+/**
+ * codec.c - EGB240DVR Library, Lossless page codec module
+ *
+ * Encodes each full buffer page of 8-bit samples into a variable size,
+ * bit-exact (lossless) block, and decodes blocks back into buffer pages
+ * for playback. Encoding runs in the main loop (page handler), never in
+ * an ISR.
+ *
+ * Each sample is predicted from the previous sample (first order
+ * prediction). The residual (modulo 256) is mapped to an unsigned value
+ * (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) and Rice coded with parameter k:
+ * the quotient u >> k in unary (ones terminated by a zero) followed by
+ * the k low bits of u, MSB first. The parameter is adapted per block by
+ * computing the exact coded size for k around log2 of the mean residual
+ * and choosing the smallest. Where coding would not reduce the size the
+ * block is stored raw, bounding every block to 515 bytes.
+ *
+ * Block layout (see CODEC_HEADER):
+ *   size (uint16), first sample (uint8), k (uint8), coded residuals for
+ *   the remaining 511 samples padded to a whole byte.
+ *
+ * The size field forms a block index through the data chunk: a reader
+ * can seek to any block by following the size fields (one 2 byte read
+ * per block), without decoding. Blocks are stored in the data chunk of
+ * a WAVE file with format tag WAVE_FORMAT_DRICE; the sample count is
+ * held in the fact chunk.
+ *
+ * Coded bits are staged through a small buffer (CODEC_STAGE bytes) so no
+ * page sized output buffer is required.
+ *
+ * Requires:
+ *   wave - WAVE file interface (reads/writes the open file)
+ *   timer - Timer module, used to measure encode time
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+/************************************************************************/
+/* INCLUDED LIBRARIES/HEADER FILES                                      */
+/************************************************************************/
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#include <stdio.h>
+
+#include "wave.h"
+#include "timer.h"
+#include "codec.h"
+
+#define CODEC_STAGE		16		// Bytes staged between file reads/writes
+
+/************************************************************************/
+/* GLOBAL VARIABLES                                                     */
+/************************************************************************/
+uint8_t codec_stage[CODEC_STAGE];	// Staging buffer for coded bytes
+uint8_t codec_index;		// Index of current byte in staging buffer
+uint8_t codec_bits;			// Current byte being assembled/consumed
+uint8_t codec_mask;			// Mask of current bit within codec_bits
+uint16_t codec_remaining;	// Coded bytes remaining in block (decoder)
+
+uint32_t codec_blocks;		// Blocks encoded since reset
+uint32_t codec_bytes;		// Bytes written since reset
+uint32_t codec_ticks;		// Encode time since reset (timer ticks)
+uint16_t codec_ticksMax;	// Longest encode time of a single block (timer ticks)
+
+/************************************************************************/
+/* PRIVATE/UTILLITY FUNCTIONS                                           */
+/************************************************************************/
+
+// Maps a residual (modulo 256) to an unsigned value (zigzag)
+static inline uint8_t zigzag(uint8_t r) {
+	return (r & 0x80) ? ((uint8_t)~r << 1) | 1 : (r << 1);
+}
+
+// Inverse of zigzag
+static inline uint8_t unzigzag(uint8_t u) {
+	return (u & 1) ? ~(u >> 1) : (u >> 1);
+}
+
+// Writes staged bytes to the WAVE file
+static void stage_flush() {
+	if (codec_index) wave_write(codec_stage, codec_index);
+	codec_index = 0;
+}
+
+// Appends a byte to the staging buffer
+static void put_byte(uint8_t b) {
+	codec_stage[codec_index++] = b;
+	if (codec_index == CODEC_STAGE) stage_flush();
+}
+
+// Appends a bit to the coded output (MSB first)
+static void put_bit(uint8_t bit) {
+	if (bit) codec_bits |= codec_mask;
+	
+	if (!(codec_mask >>= 1)) {
+		put_byte(codec_bits);
+		codec_bits = 0;
+		codec_mask = 0x80;
+	}
+}
+
+// Reads the next byte of the current block into the staging buffer where required
+// Reads beyond the end of the block (corrupt block) return zero, so the remaining
+// residuals decode as zero and the rest of the page holds the last sample
+static uint8_t get_byte() {
+	if (codec_index == CODEC_STAGE) {
+		if (!codec_remaining) return 0;
+		
+		uint16_t n = (codec_remaining < CODEC_STAGE) ? codec_remaining : CODEC_STAGE;
+		
+		// Read right-aligned so that the next byte is always at codec_index
+		codec_index = CODEC_STAGE - n;
+		wave_read(codec_stage + codec_index, n);
+		codec_remaining -= n;
+	}
+	
+	return codec_stage[codec_index++];
+}
+
+// Reads the next coded bit (MSB first)
+static uint8_t get_bit() {
+	uint8_t bit;
+	
+	if (!codec_mask) {
+		codec_bits = get_byte();
+		codec_mask = 0x80;
+	}
+	
+	bit = codec_bits & codec_mask;
+	codec_mask >>= 1;
+	
+	return bit;
+}
+
+// Returns the coded size in bits of the residuals of a page for Rice parameter k
+static uint32_t coded_bits(uint8_t* pSamples, uint8_t k) {
+	uint32_t bits = 0;
+	uint8_t prev = pSamples[0];
+	
+	for (uint16_t i = 1; i < CODEC_BLOCK_SAMPLES; i++) {
+		bits += (zigzag(pSamples[i] - prev) >> k) + 1 + k;
+		prev = pSamples[i];
+	}
+	
+	return bits;
+}
+
+/************************************************************************/
+/* PUBLIC/USER FUNCTIONS                                                */
+/************************************************************************/
+
+/**
+ * Function: codec_reset
+ * 
+ * Resets the compression statistics. Call before recording starts.
+ */
+void codec_reset() {
+	codec_blocks = 0;
+	codec_bytes = 0;
+	codec_ticks = 0;
+	codec_ticksMax = 0;
+}
+
+/**
+ * Function: codec_encode
+ * 
+ * Encodes a full page of samples into a single block, which is written
+ * to the open WAVE file (wave_write). The number of samples encoded is
+ * reported to the WAVE module (wave_encoded).
+ *
+ * Parameters:
+ *    pSamples - Pointer to page of 8-bit samples (CODEC_BLOCK_SAMPLES).
+ */
+void codec_encode(uint8_t* pSamples) {
+	uint16_t start = timer_now();
+	uint16_t elapsed;
+	uint32_t bits;
+	uint32_t best;
+	uint16_t sum = 0;
+	uint8_t k = 0;
+	uint8_t prev = pSamples[0];
+	CODEC_HEADER header;
+	
+	// Estimate Rice parameter from mean of mapped residuals
+	for (uint16_t i = 1; i < CODEC_BLOCK_SAMPLES; i++) {
+		sum += zigzag(pSamples[i] - prev) >> 1;	// Halved to avoid overflow
+		prev = pSamples[i];
+	}
+	sum >>= 8;		// Sum of 511 halved values / 256 ~ mean
+	while (sum && (k < CODEC_K_MAX)) {
+		sum >>= 1;
+		k++;
+	}
+	
+	// Refine estimate using exact coded size of neighbouring parameters
+	best = coded_bits(pSamples, k);
+	if (k < CODEC_K_MAX) {
+		bits = coded_bits(pSamples, k + 1);
+		if (bits < best) {
+			best = bits;
+			k++;
+		}
+	}
+	if (k > 0) {
+		bits = coded_bits(pSamples, k - 1);
+		if (bits < best) {
+			best = bits;
+			k--;
+		}
+	}
+	
+	// Write block header
+	header.first = pSamples[0];
+	if (best >= (CODEC_BLOCK_SAMPLES - 1) * 8) {
+		header.k = CODEC_RAW;
+		header.size = CODEC_HEADER_SIZE + CODEC_BLOCK_SAMPLES - 1;
+	} else {
+		header.k = k;
+		header.size = CODEC_HEADER_SIZE + ((best + 7) >> 3);
+	}
+	wave_write((uint8_t*)&header, CODEC_HEADER_SIZE);
+	
+	// Write residuals
+	codec_index = 0;
+	if (header.k == CODEC_RAW) {
+		wave_write(pSamples + 1, CODEC_BLOCK_SAMPLES - 1);
+	} else {
+		codec_bits = 0;
+		codec_mask = 0x80;
+		prev = pSamples[0];
+		
+		for (uint16_t i = 1; i < CODEC_BLOCK_SAMPLES; i++) {
+			uint8_t u = zigzag(pSamples[i] - prev);
+			prev = pSamples[i];
+			
+			// Quotient in unary, then k bit remainder
+			for (uint8_t q = u >> k; q; q--) put_bit(1);
+			put_bit(0);
+			for (uint8_t m = (1 << k) >> 1; m; m >>= 1) put_bit(u & m);
+		}
+		
+		if (codec_mask != 0x80) put_byte(codec_bits);	// Pad final byte
+		stage_flush();
+	}
+	
+	wave_encoded(CODEC_BLOCK_SAMPLES);
+	
+	// Statistics
+	elapsed = timer_now() - start;
+	codec_blocks++;
+	codec_bytes += header.size;
+	codec_ticks += elapsed;
+	if (elapsed > codec_ticksMax) codec_ticksMax = elapsed;
+}
+
+/**
+ * Function: codec_decode
+ * 
+ * Reads the next block from the open WAVE file (wave_read) and decodes it
+ * into a full page of samples. Where no data remains, the page is filled
+ * with silence.
+ *
+ * Parameters:
+ *    pSamples - Pointer to page to receive 8-bit samples (CODEC_BLOCK_SAMPLES).
+ *
+ * Returns: The number of samples decoded (0 at end of data).
+ */
+uint16_t codec_decode(uint8_t* pSamples) {
+	CODEC_HEADER header;
+	uint8_t prev;
+	
+	wave_read((uint8_t*)&header, CODEC_HEADER_SIZE);
+	
+	if (header.k == CODEC_RAW) {
+		pSamples[0] = header.first;
+		wave_read(pSamples + 1, CODEC_BLOCK_SAMPLES - 1);
+		return CODEC_BLOCK_SAMPLES;
+	}
+	
+	if ((header.k > CODEC_K_MAX) || (header.size < CODEC_HEADER_SIZE)) {
+		// Invalid block (or end of data), output silence
+		for (uint16_t i = 0; i < CODEC_BLOCK_SAMPLES; i++) pSamples[i] = 0x80;
+		return 0;
+	}
+	
+	codec_remaining = header.size - CODEC_HEADER_SIZE;
+	codec_index = CODEC_STAGE;
+	codec_mask = 0;
+	
+	prev = pSamples[0] = header.first;
+	for (uint16_t i = 1; i < CODEC_BLOCK_SAMPLES; i++) {
+		uint8_t u = 0;
+		
+		// Unary quotient (bounded, as u is at most 255)
+		while (get_bit() && (u < 0xFF)) u++;
+		u <<= header.k;
+		for (uint8_t m = (1 << header.k) >> 1; m; m >>= 1) {
+			if (get_bit()) u |= m;
+		}
+		
+		prev += unzigzag(u);
+		pSamples[i] = prev;
+	}
+	
+	// Discard any unread bytes of block
+	while (codec_remaining) {
+		uint16_t n = (codec_remaining < CODEC_STAGE) ? codec_remaining : CODEC_STAGE;
+		wave_read(codec_stage, n);
+		codec_remaining -= n;
+	}
+	
+	return CODEC_BLOCK_SAMPLES;
+}
+
+/**
+ * Function: codec_report
+ * 
+ * Prints the compression ratio and the mean/maximum encode time per page
+ * (in CPU cycles, at 1024 cycles per 64 us timer tick) since reset.
+ */
+void codec_report() {
+	if (!codec_blocks) return;
+	
+	printf_P(PSTR("Codec: %lu blocks, ratio %lu.%02lu:1, %lu cycles/page (max %lu)\n"),
+		codec_blocks,
+		(codec_blocks * CODEC_BLOCK_SAMPLES) / codec_bytes,
+		((codec_blocks * CODEC_BLOCK_SAMPLES * 100) / codec_bytes) % 100,
+		(codec_ticks * 1024) / codec_blocks,
+		(uint32_t)codec_ticksMax * 1024);
+}
@@ -0,0 +1,30 @@
+/**
+ * codec.h - EGB240DVR Library, Lossless page codec module header
+ *
+ * Lossless delta + Rice coding of 8-bit audio, one block per buffer page.
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+#define CODEC_BLOCK_SAMPLES	512		// Samples per block (one buffer page)
+#define CODEC_HEADER_SIZE	4		// Bytes of block header
+#define CODEC_K_MAX			7		// Largest Rice parameter
+#define CODEC_RAW			0xFF	// Rice parameter value indicating a raw (uncoded) block
+
+// Block header (followed by Rice coded residuals, or raw samples)
+typedef struct {
+	uint16_t	size;		// Size of block in bytes, including header
+	uint8_t		first;		// First sample of block (unsigned 8-bit)
+	uint8_t		k;			// Rice parameter (0-7), or CODEC_RAW
+} CODEC_HEADER;
+
+void codec_reset();					// Resets statistics (call before recording)
+void codec_encode(uint8_t* pSamples);	// Encodes a page and writes it to the open WAVE file
+uint16_t codec_decode(uint8_t* pSamples);	// Reads and decodes a block from the open WAVE file into a page
+void codec_report();				// Prints compression ratio and encode time
+
+#endif /* CODEC_H_ */
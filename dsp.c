@@ -0,0 +1,215 @@
+/**
+ * dsp.c - EGB240DVR Library, Record DSP module
+ *
+ * Per-sample fixed-point processing applied to recorded audio between
+ * the ADC result and the circular buffer. Each stage may be enabled
+ * independently (dsp_config). With no stages enabled the ADC module
+ * bypasses this module entirely.
+ *
+ * Samples are processed as signed Q15 values (full scale +/-32768),
+ * and converted to unsigned 8-bit (0x80 midpoint) on output. The
+ * multiplies are written as 16 x 16 and 16 x 8 bit products which
+ * avr-gcc maps onto the hardware MUL/MULS/MULSU instructions (2 cycles
+ * per 8 x 8 partial product).
+ *
+ * Stages (in order) and cost per sample at 16 MHz, estimated from
+ * instruction counts (measure on the target with dsp_cycles, console
+ * command 'b', which times each stage with Timer1):
+ *
+ *   DC blocker   y = x - x[n-1] + a.y[n-1]     16x16 multiply  ~40 cycles
+ *   Pre-emphasis y = x - b.x[n-1]              16x8 multiply   ~25 cycles
+ *   AGC          y = g.x, peak tracking        16x8 multiply   ~35 cycles
+ *   Output       saturate, offset to 8 bits                    ~10 cycles
+ *
+ * All stages together add ~110 cycles to the ADC ISR, of the 1024
+ * cycles available per sample at 15.625 kHz. The AGC gain is updated
+ * once per page (dsp_page, ~30 cycles) from the measured page peak:
+ * the gain steps down by 1/8 where the page peak exceeds DSP_AGC_HIGH
+ * and up by 1/32 where it is below DSP_AGC_LOW (fast attack, slow
+ * release), and is held where the page is effectively silent.
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+/************************************************************************/
+/* INCLUDED LIBRARIES/HEADER FILES                                      */
+/************************************************************************/
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "dsp.h"
+
+/************************************************************************/
+/* GLOBAL VARIABLES                                                     */
+/************************************************************************/
+volatile uint8_t dsp_flags = 0x00;	// Enabled processing stages (DSP_*)
+
+int16_t dc_x1;		// DC blocker: previous input
+int16_t dc_y1;		// DC blocker: previous output
+int16_t pe_x1;		// Pre-emphasis: previous input
+uint8_t agc_gain = DSP_AGC_UNITY;	// AGC: current gain (Q4.4)
+uint16_t agc_peak;	// AGC: peak magnitude (before gain) in current page
+
+/************************************************************************/
+/* PRIVATE/UTILLITY FUNCTIONS                                           */
+/************************************************************************/
+
+// Saturates a 32-bit intermediate result to Q15
+static inline int16_t sat16(int32_t x) {
+	if (x > 32767) return 32767;
+	if (x < -32768) return -32768;
+	return x;
+}
+
+/************************************************************************/
+/* PUBLIC/USER FUNCTIONS                                                */
+/************************************************************************/
+
+/**
+ * Function: dsp_config
+ * 
+ * Selects the processing stages applied to recorded samples and resets
+ * the filter state. AGC gain is reset to unity. Must not be called
+ * while the ADC is running.
+ *
+ * Parameters:
+ *    flags - Combination of DSP_DCBLOCK, DSP_PREEMPH, DSP_AGC (0 = bypass)
+ */
+void dsp_config(uint8_t flags) {
+	dc_x1 = 0;
+	dc_y1 = 0;
+	pe_x1 = 0;
+	agc_gain = DSP_AGC_UNITY;
+	agc_peak = 0;
+	
+	dsp_flags = flags;
+}
+
+/**
+ * Function: dsp_process
+ * 
+ * Applies the enabled processing stages to a single sample. Called from
+ * the ADC ISR for every sample queued into the buffer.
+ *
+ * Parameters:
+ *    x - Input sample, signed Q15 (ADC midscale = 0)
+ *
+ * Returns: Processed sample, unsigned 8-bit (0x80 = midscale)
+ */
+uint8_t dsp_process(int16_t x) {
+	int16_t y;
+	uint16_t mag;
+	
+	if (dsp_flags & DSP_DCBLOCK) {
+		// y[n] = x[n] - x[n-1] + a.y[n-1]
+		y = sat16((int32_t)x - dc_x1 + (((int32_t)dc_y1 * DSP_DC_POLE) >> 15));
+		dc_x1 = x;
+		dc_y1 = y;
+		x = y;
+	}
+	
+	if (dsp_flags & DSP_PREEMPH) {
+		// y[n] = x[n] - b.x[n-1]
+		y = sat16((int32_t)x - (((int32_t)pe_x1 * (uint8_t)DSP_PREEMPH_COEF) >> 8));
+		pe_x1 = x;
+		x = y;
+	}
+	
+	if (dsp_flags & DSP_AGC) {
+		// Track page peak (before gain)
+		mag = (x < 0) ? -(uint16_t)x : (uint16_t)x;
+		if (mag > agc_peak) agc_peak = mag;
+		
+		// y[n] = g.x[n], g in Q4.4
+		x = sat16(((int32_t)x * agc_gain) >> 4);
+	}
+	
+	// Round to 8 bits and offset to unsigned midscale
+	y = (x >> 8) + ((x >> 7) & 1);
+	if (y > 127) y = 127;
+	
+	return (uint8_t)(y + 128);
+}
+
+/**
+ * Function: dsp_page
+ * 
+ * Updates the AGC gain on the basis of the peak measured over the last
+ * page. Must be called once per buffer page (from the "page full"
+ * callback), in the same interrupt context as dsp_process.
+ */
+void dsp_page() {
+	uint32_t peak;
+	
+	if (!(dsp_flags & DSP_AGC)) return;
+	
+	// Peak after current gain (Q15), 16x8 multiply
+	peak = ((uint32_t)agc_peak * agc_gain) >> 4;
+	agc_peak = 0;
+	
+	if (peak > DSP_AGC_HIGH) {
+		// Attack: reduce gain by 1/8
+		agc_gain -= (agc_gain >> 3) ? (agc_gain >> 3) : 1;
+		if (agc_gain < DSP_AGC_MIN) agc_gain = DSP_AGC_MIN;
+	} else if ((peak < DSP_AGC_LOW) && (peak > DSP_AGC_FLOOR)) {
+		// Release: increase gain by 1/32
+		uint8_t step = (agc_gain >> 5) ? (agc_gain >> 5) : 1;
+		agc_gain = (agc_gain > DSP_AGC_MAX - step) ? DSP_AGC_MAX : agc_gain + step;
+	}
+}
+
+/**
+ * Function: dsp_gain
+ * 
+ * Returns: Current AGC gain (Q4.4, 16 = unity)
+ */
+uint8_t dsp_gain() {
+	return agc_gain;
+}
+
+/**
+ * Function: dsp_cycles
+ * 
+ * Measures the cost of dsp_process with a set of stages enabled: the
+ * Timer1 count (16 MHz, no prescaler) across DSP_BENCH_SAMPLES calls on
+ * a test signal (a ramp through full scale, so the saturation paths are
+ * taken), with interrupts disabled. The count includes the call and the
+ * loop (~10 cycles); the cost of a stage is the difference from the
+ * count with no stages enabled. Uses Timer1 (PWM output, oversampling
+ * trigger), so must only be called while stopped. Filter state is reset
+ * (the stages enabled before the call are restored).
+ *
+ * Parameters:
+ *    flags - Combination of DSP_DCBLOCK, DSP_PREEMPH, DSP_AGC (0 = output only)
+ *
+ * Returns: Average cycles per sample.
+ */
+uint16_t dsp_cycles(uint8_t flags) {
+	uint8_t saved = dsp_flags;
+	uint8_t tccr1a = TCCR1A;
+	uint8_t tccr1b = TCCR1B;
+	uint16_t x = 0;
+	uint16_t start, end;
+	volatile uint8_t sink;
+	
+	dsp_config(flags);
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		TCCR1A = 0x00;	// Normal mode
+		TCCR1B = 0x01;	// No prescaler (1 count per cycle)
+		start = TCNT1;
+		for (uint8_t i = 0; i < DSP_BENCH_SAMPLES; i++) {
+			sink = dsp_process((int16_t)x);
+			x += 1021;
+		}
+		end = TCNT1;
+		TCCR1B = tccr1b;
+		TCCR1A = tccr1a;
+	}
+	(void)sink;
+	
+	dsp_config(saved);
+	
+	return (end - start) / DSP_BENCH_SAMPLES;
+}
@@ -0,0 +1,41 @@
+/**
+ * dsp.h - EGB240DVR Library, Record DSP module header
+ *
+ * Fixed-point processing of recorded samples (DC blocker, pre-emphasis,
+ * automatic gain control) between the ADC and the circular buffer.
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+#ifndef DSP_H_
+#define DSP_H_
+
+// Processing stages (dsp_config flags)
+#define DSP_DCBLOCK		0x01	// One-pole DC blocking filter
+#define DSP_PREEMPH		0x02	// First order pre-emphasis
+#define DSP_AGC			0x04	// Block-based automatic gain control
+
+// Filter coefficients
+#define DSP_DC_POLE		32604	// DC blocker pole (Q15), 0.995 (~12 Hz corner at 15.625 kHz)
+#define DSP_PREEMPH_COEF	240		// Pre-emphasis coefficient (Q8), 0.9375
+
+// Automatic gain control (gain is Q4.4, 16 = unity)
+#define DSP_AGC_UNITY	16		// Unity gain
+#define DSP_AGC_MIN		4		// Minimum gain (x0.25)
+#define DSP_AGC_MAX		255		// Maximum gain (x15.9)
+#define DSP_AGC_HIGH	24576	// Page peak above which gain is reduced (-2.5 dBFS)
+#define DSP_AGC_LOW		12288	// Page peak below which gain is increased (-8.5 dBFS)
+#define DSP_AGC_FLOOR	512		// Page peak below which gain is held (silence)
+
+#define DSP_BENCH_SAMPLES	64	// Samples processed per measurement (dsp_cycles)
+
+extern volatile uint8_t dsp_flags;	// Enabled processing stages
+
+void dsp_config(uint8_t flags);		// Selects processing stages and resets filter state
+uint8_t dsp_process(int16_t x);		// Processes one sample (Q15) into an 8-bit sample
+void dsp_page();					// Updates AGC gain (call once per buffer page)
+uint8_t dsp_gain();					// Returns current AGC gain (Q4.4)
+uint16_t dsp_cycles(uint8_t flags);	// Measures cycles per sample with stages enabled (Timer1, while stopped)
+
+#endif /* DSP_H_ */
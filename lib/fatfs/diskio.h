@@ -33,6 +33,8 @@ typedef enum {
 
 
 DSTATUS disk_initialize (BYTE pdrv);
+DSTATUS disk_start (BYTE pdrv);
+int disk_poll (BYTE pdrv);
 DSTATUS disk_status (BYTE pdrv);
 DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 #if	_USE_WRITE
@@ -73,6 +75,10 @@ void disk_timerproc (void);
 #define MMC_GET_CID			52	/* Get CID */
 #define MMC_GET_OCR			53	/* Get OCR */
 #define MMC_GET_SDSTAT		54	/* Get SD status */
+#define MMC_GET_BUSY		55	/* Get (and clear) card busy statistics */
+#define MMC_SET_CRC			56	/* Enable/disable CRC of data blocks */
+#define MMC_GET_CRCERR		57	/* Get (and clear) count of CRC errors */
+#define MMC_GET_READY		58	/* Check card is ready (not busy), without waiting */
 
 /* ATA/CF specific command (Not used by FatFs) */
 #define ATA_GET_REV			60	/* Get F/W revision */
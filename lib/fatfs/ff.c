@@ -2199,6 +2199,10 @@ BYTE check_fs (	/* 0:Valid FAT-BS, 1:Valid BS but not FAT, 2:Not a BS, 3:Disk er
 /* Find logical drive and check if the volume is mounted                 */
 /*-----------------------------------------------------------------------*/
 
+#if !_FS_READONLY && _USE_RECLAIM
+static FRESULT reclaim_chain (FATFS* fs, UINT ncl);
+#endif
+
 static
 FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	FATFS** rfs,		/* Pointer to pointer to the found file system object */
@@ -2213,6 +2217,9 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	WORD nrsv;
 	FATFS *fs;
 	UINT i;
+#if !_FS_READONLY && _USE_RECLAIM
+	DWORD vsn;
+#endif
 
 
 	/* Get logical drive number from the path name */
@@ -2326,6 +2333,14 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 #if !_FS_READONLY
 	/* Initialize cluster allocation information */
 	fs->last_clust = fs->free_clust = 0xFFFFFFFF;
+#if _USE_RECLAIM
+	vsn = LD_DWORD(fs->win + (fmt == FS_FAT32 ? BS_VolID32 : BS_VolID));	/* Volume serial number */
+	for (i = 0; i < _RECLAIM_QUEUE; i++) {
+		if (vsn != fs->vsn || fs->reclaim[i] >= fs->n_fatent)
+			fs->reclaim[i] = 0;	/* Chain pending on another volume is not ours to remove */
+	}
+	fs->vsn = vsn;
+#endif
 
 	/* Get fsinfo if available */
 	fs->fsi_flag = 0x80;
@@ -2357,6 +2372,10 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 #if _FS_LOCK			/* Clear file lock semaphores */
 	clear_lock(fs);
 #endif
+#if !_FS_READONLY && _USE_RECLAIM
+	while (fs->reclaim[0])	/* Finish removal pending before remount */
+		reclaim_chain(fs, 0xFFFF);	/* (A chain failing is left as lost clusters) */
+#endif
 
 	return FR_OK;
 }
@@ -3829,6 +3848,284 @@ FRESULT f_utime (
 
 
 
+#if !_FS_READONLY && _USE_RECLAIM
+/*-----------------------------------------------------------------------*/
+/* Remove Clusters Pending Removal (up to a number of clusters)          */
+/*-----------------------------------------------------------------------*/
+/* Chains are removed in the order queued by f_cut (fs->reclaim[0] is    */
+/* the chain being removed). Each pending chain is unlinked from any     */
+/* file, so the FAT is consistent (other than lost clusters) at the end  */
+/* of each batch. A chain failing removal is dropped from the queue and  */
+/* left as lost clusters.                                                */
+
+static
+void reclaim_next (
+	FATFS* fs			/* File system object */
+)
+{
+	UINT i;
+
+
+	for (i = 1; i < _RECLAIM_QUEUE; i++) fs->reclaim[i - 1] = fs->reclaim[i];
+	fs->reclaim[_RECLAIM_QUEUE - 1] = 0;
+}
+
+
+static
+FRESULT reclaim_chain (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs,			/* File system object */
+	UINT ncl			/* Maximum number of clusters to remove */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD clst, nxt;
+
+
+	clst = fs->reclaim[0];
+	while (ncl && clst) {
+		if (clst < 2 || clst >= fs->n_fatent) {	/* End of chain? Continue with next queued */
+			reclaim_next(fs);
+			clst = fs->reclaim[0];
+			continue;
+		}
+		nxt = get_fat(fs, clst);			/* Get cluster status */
+		if (nxt == 0) { clst = 0; break; }	/* Empty cluster? (end of chain) */
+		if (nxt == 1) { res = FR_INT_ERR; break; }	/* Internal error? */
+		if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }	/* Disk error? */
+		res = put_fat(fs, clst, 0);			/* Mark the cluster "empty" */
+		if (res != FR_OK) break;
+		if (fs->free_clust != 0xFFFFFFFF) {	/* Update FSINFO */
+			fs->free_clust++;
+			fs->fsi_flag |= 1;
+		}
+		clst = nxt;	/* Next cluster */
+		ncl--;
+	}
+	if (res != FR_OK) clst = 0;				/* Drop failing chain */
+	fs->reclaim[0] = clst;
+	if (clst < 2 || clst >= fs->n_fatent) reclaim_next(fs);	/* End of chain? */
+
+	if (res == FR_OK) {		/* Flush the FAT sector (and FSINFO when complete) */
+		res = fs->reclaim[0] ? sync_window(fs) : sync_fs(fs);
+	}
+	return res;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Truncate File, Deferring Removal of Remaining Clusters                */
+/*-----------------------------------------------------------------------*/
+/* The remaining chain is unlinked and queued (fs->reclaim), no cluster */
+/* is freed here. FR_LOCKED is returned while the queue is full.         */
+
+FRESULT f_cut (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	DWORD ncl = 0;
+	UINT q;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res == FR_OK) {
+		if (fp->err) {						/* Check error */
+			res = (FRESULT)fp->err;
+		} else {
+			if (!(fp->flag & FA_WRITE))		/* Check access mode */
+				res = FR_DENIED;
+		}
+	}
+	if (res == FR_OK && fp->fsize > fp->fptr && fp->fs->reclaim[_RECLAIM_QUEUE - 1]) {
+		res = FR_LOCKED;					/* Queue of pending chains is full (retry after f_reclaim) */
+	}
+	if (res == FR_OK) {
+		if (fp->fsize > fp->fptr) {
+			fp->fsize = fp->fptr;	/* Set file size to current R/W point */
+			fp->flag |= FA__WRITTEN;
+			if (fp->fptr == 0) {	/* When set file size to zero, unlink entire cluster chain */
+				ncl = fp->sclust;
+				fp->sclust = 0;
+			} else {				/* When truncate a part of the file, unlink remaining clusters */
+				ncl = get_fat(fp->fs, fp->clust);
+				if (ncl == 0xFFFFFFFF) res = FR_DISK_ERR;
+				if (ncl == 1) res = FR_INT_ERR;
+				if (res == FR_OK && ncl < fp->fs->n_fatent) {
+					res = put_fat(fp->fs, fp->clust, 0x0FFFFFFF);
+				} else {
+					ncl = 0;
+				}
+			}
+			if (res == FR_OK && ncl) {		/* Queue chain, removed by f_reclaim */
+				for (q = 0; fp->fs->reclaim[q]; q++) ;
+				fp->fs->reclaim[q] = ncl;
+			}
+#if !_FS_TINY
+			if (res == FR_OK && (fp->flag & FA__DIRTY)) {
+				if (disk_write(fp->fs->drv, fp->buf, fp->dsect, 1) != RES_OK)
+					res = FR_DISK_ERR;
+				else
+					fp->flag &= ~FA__DIRTY;
+			}
+#endif
+		}
+		if (res != FR_OK) fp->err = (FRESULT)res;
+	}
+
+	LEAVE_FF(fp->fs, res);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Set File Size to the Extent of its Cluster Chain                      */
+/*-----------------------------------------------------------------------*/
+/* For a file written but not closed (power loss), the directory size   */
+/* lags the clusters allocated. The size is extended to the end of the   */
+/* last cluster so the data may be read and the file closed at its real */
+/* length. The R/W pointer is not moved.                                 */
+
+FRESULT f_extent (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	DWORD clst, ncl = 0, bcs;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res == FR_OK) {
+		if (fp->err) {						/* Check error */
+			res = (FRESULT)fp->err;
+		} else {
+			if (!(fp->flag & FA_WRITE))		/* Check access mode */
+				res = FR_DENIED;
+		}
+	}
+	if (res == FR_OK) {
+		clst = fp->sclust;					/* Count clusters of chain */
+		while (clst >= 2 && clst < fp->fs->n_fatent) {
+			ncl++;
+			clst = get_fat(fp->fs, clst);
+			if (clst == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (clst == 1) { res = FR_INT_ERR; break; }
+		}
+		bcs = (DWORD)fp->fs->csize * SS(fp->fs);	/* Cluster size (byte) */
+		if (res == FR_OK && ncl * bcs > fp->fsize) {
+			fp->fsize = ncl * bcs;
+			fp->flag |= FA__WRITTEN;
+		}
+		if (res != FR_OK) fp->err = (FRESULT)res;
+	}
+
+	LEAVE_FF(fp->fs, res);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Remove Clusters Unlinked by f_cut                                     */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_reclaim (
+	FATFS* fs,	/* File system object */
+	UINT ncl	/* Maximum number of clusters to remove in this call */
+)
+{
+	FRESULT res = FR_OK;
+
+
+	if (!fs || !fs->fs_type) return FR_INVALID_OBJECT;
+	if (fs->reclaim[0]) res = reclaim_chain(fs, ncl);
+
+	return res;
+}
+#endif /* !_FS_READONLY && _USE_RECLAIM */
+
+
+
+#if !_FS_READONLY && _USE_ERASE
+/*-----------------------------------------------------------------------*/
+/* Pre-erase Clusters of a File                                          */
+/*-----------------------------------------------------------------------*/
+/* Erases clusters from the offset (rounded up to a cluster boundary) to */
+/* the end of the file: one contiguous run of at most ncl clusters per   */
+/* call, with a single CTRL_TRIM. The walk state is held by the caller: */
+/* the offset and the last cluster of the run are returned, so a call    */
+/* continuing from there reads one FAT entry rather than following the  */
+/* chain. The R/W pointer of the file object is not moved.               */
+
+FRESULT f_erase (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD ofs,		/* File offset to erase from */
+	UINT ncl,		/* Maximum number of clusters to erase */
+	DWORD* next,	/* Offset to continue from (file size where complete) */
+	DWORD* cur		/* In: cluster before ofs returned by the previous call (0:none), out: for the next call */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD bcs, clst, nxt, scl, ecl, rt[2];
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res == FR_OK) {
+		if (fp->err) {						/* Check error */
+			res = (FRESULT)fp->err;
+		} else {
+			if (!(fp->flag & FA_WRITE))		/* Check access mode */
+				res = FR_DENIED;
+		}
+	}
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+
+	fs = fp->fs;
+	bcs = (DWORD)fs->csize * SS(fs);		/* Cluster size (byte) */
+	ofs = (ofs + bcs - 1) / bcs * bcs;		/* Start of first whole cluster */
+	if (ofs >= fp->fsize || !fp->sclust) {	/* Nothing to erase */
+		*next = fp->fsize;
+		*cur = 0;
+		LEAVE_FF(fs, FR_OK);
+	}
+
+	if (ofs && *cur) {						/* Continue from cursor (cluster before ofs) */
+		clst = get_fat(fs, *cur);
+		if (clst == 0xFFFFFFFF) res = FR_DISK_ERR;
+		else if (clst < 2 || clst >= fs->n_fatent) res = FR_INT_ERR;
+	} else {
+		clst = fp->sclust;					/* Follow chain to first cluster */
+		for (nxt = ofs / bcs; nxt && res == FR_OK; nxt--) {
+			clst = get_fat(fs, clst);
+			if (clst == 0xFFFFFFFF) res = FR_DISK_ERR;
+			else if (clst < 2 || clst >= fs->n_fatent) res = FR_INT_ERR;
+		}
+	}
+
+	scl = ecl = clst;
+	while (res == FR_OK) {
+		ofs += bcs;
+		nxt = (ofs < fp->fsize && --ncl) ? get_fat(fs, ecl) : 0;	/* Next cluster within range */
+		if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (nxt >= 2 && nxt < fs->n_fatent && nxt == ecl + 1) {	/* Contiguous? */
+			ecl = nxt;
+			continue;
+		}
+		rt[0] = clust2sect(fs, scl);					/* Start sector */
+		rt[1] = clust2sect(fs, ecl) + fs->csize - 1;	/* End sector */
+		if (disk_ioctl(fs->drv, CTRL_TRIM, rt) != RES_OK) res = FR_DISK_ERR;
+		break;		/* One run per call (card is busy until the erase completes) */
+	}
+	*cur = (res == FR_OK && ofs < fp->fsize) ? ecl : 0;	/* Cursor at end of run */
+	*next = (ofs < fp->fsize) ? ofs : fp->fsize;
+
+	LEAVE_FF(fs, res);
+}
+#endif /* !_FS_READONLY && _USE_ERASE */
+
+
+
+
 #if _USE_LABEL
 /*-----------------------------------------------------------------------*/
 /* Get volume label                                                      */
@@ -4074,6 +4371,7 @@ FRESULT f_mkfs (
 	UINT i;
 	DWORD b_vol, b_fat, b_dir, b_data;	/* LBA */
 	DWORD n_vol, n_rsv, n_fat, n_dir;	/* Size */
+	DWORD sz_blk;						/* Erase block size */
 	FATFS *fs;
 	DSTATUS stat;
 #if _USE_TRIM
@@ -4088,6 +4386,9 @@ FRESULT f_mkfs (
 	fs = FatFs[vol];
 	if (!fs) return FR_NOT_ENABLED;
 	fs->fs_type = 0;
+#if _USE_RECLAIM
+	mem_set(fs->reclaim, 0, sizeof fs->reclaim);	/* Pending chains are discarded with the old volume */
+#endif
 	pdrv = LD2PD(vol);	/* Physical drive */
 	part = LD2PT(vol);	/* Partition (0:auto detect, 1-4:get from partition table)*/
 
@@ -4099,6 +4400,8 @@ FRESULT f_mkfs (
 	if (disk_ioctl(pdrv, GET_SECTOR_SIZE, &SS(fs)) != RES_OK || SS(fs) > _MAX_SS || SS(fs) < _MIN_SS)
 		return FR_DISK_ERR;
 #endif
+	/* Get erase block size (partition and data area are aligned to it, up to the 64 MB SD maximum) */
+	if (disk_ioctl(pdrv, GET_BLOCK_SIZE, &sz_blk) != RES_OK || !sz_blk || sz_blk > 131072) sz_blk = 1;
 	if (_MULTI_PARTITION && part) {
 		/* Get partition information from partition table in the MBR */
 		if (disk_read(pdrv, fs->win, 0, 1) != RES_OK) return FR_DISK_ERR;
@@ -4111,7 +4414,8 @@ FRESULT f_mkfs (
 		/* Create a partition in this function */
 		if (disk_ioctl(pdrv, GET_SECTOR_COUNT, &n_vol) != RES_OK || n_vol < 128)
 			return FR_DISK_ERR;
-		b_vol = (sfd) ? 0 : 63;		/* Volume start sector */
+		b_vol = (sfd) ? 0 : (63 + sz_blk - 1) / sz_blk * sz_blk;	/* Volume start sector (first erase block boundary from 63) */
+		if (n_vol < b_vol + 128) return FR_MKFS_ABORTED;
 		n_vol -= b_vol;				/* Volume size */
 	}
 
@@ -4148,15 +4452,19 @@ FRESULT f_mkfs (
 	if (n_vol < b_data + au - b_vol) return FR_MKFS_ABORTED;	/* Too small volume */
 
 	/* Align data start sector to erase block boundary (for flash memory media) */
-	if (disk_ioctl(pdrv, GET_BLOCK_SIZE, &n) != RES_OK || !n || n > 32768) n = 1;
-	n = (b_data + n - 1) & ~(n - 1);	/* Next nearest erase block from current data start */
-	n = (n - b_data) / N_FATS;
-	if (fmt == FS_FAT32) {		/* FAT32: Move FAT offset */
+	/* (erase block need not be a power of 2, e.g. 12 MB and 24 MB SD AUs) */
+	n = (b_data + sz_blk - 1) / sz_blk * sz_blk;	/* Next nearest erase block from current data start */
+	n = n - b_data;						/* Gap to be inserted before the data area */
+	if (fmt == FS_FAT32 && n_rsv + n <= 0xFFFF) {	/* FAT32: Move FAT offset (by the whole gap) */
 		n_rsv += n;
 		b_fat += n;
-	} else {					/* FAT12/16: Expand FAT size */
-		n_fat += n;
+	} else {					/* FAT12/16 (or gap too large for reserved area): Expand FAT size */
+		n_fat += n / N_FATS;
+		n_rsv += n % N_FATS;	/* Remainder moves FAT offset, so the whole gap is inserted */
+		b_fat += n % N_FATS;
 	}
+	if (fmt != FS_FAT32 && n_fat > 0xFFFF) return FR_MKFS_ABORTED;	/* (BPB_FATSz16 overflow) */
+	if (n_vol < n_rsv + n_fat * N_FATS + n_dir + au) return FR_MKFS_ABORTED;	/* Too small volume */
 
 	/* Determine number of clusters and final check of validity of the FAT sub-type */
 	n_clst = (n_vol - n_rsv - n_fat * N_FATS - n_dir) / au;
@@ -4188,15 +4496,16 @@ FRESULT f_mkfs (
 		} else {	/* Create partition table (FDISK) */
 			mem_set(fs->win, 0, SS(fs));
 			tbl = fs->win + MBR_Table;	/* Create partition table for single partition in the drive */
-			tbl[1] = 1;						/* Partition start head */
-			tbl[2] = 1;						/* Partition start sector */
-			tbl[3] = 0;						/* Partition start cylinder */
+			n = b_vol / 63 / 255;
+			tbl[1] = (BYTE)(b_vol / 63 % 255);				/* Partition start head */
+			tbl[2] = (BYTE)(b_vol % 63 + 1) | (BYTE)(n >> 2 & 0xC0);	/* Partition start sector */
+			tbl[3] = (BYTE)n;								/* Partition start cylinder */
 			tbl[4] = sys;					/* System type */
 			tbl[5] = 254;					/* Partition end head */
 			n = (b_vol + n_vol) / 63 / 255;
 			tbl[6] = (BYTE)(n >> 2 | 63);	/* Partition end sector */
 			tbl[7] = (BYTE)n;				/* End cylinder */
-			ST_DWORD(tbl + 8, 63);			/* Partition start in LBA */
+			ST_DWORD(tbl + 8, b_vol);		/* Partition start in LBA */
 			ST_DWORD(tbl + 12, n_vol);		/* Partition size in LBA */
 			ST_WORD(fs->win + BS_55AA, 0xAA55);	/* MBR signature */
 			if (disk_write(pdrv, fs->win, 0, 1) != RES_OK)	/* Write it to the MBR */
@@ -94,6 +94,10 @@ typedef struct {
 	DWORD	last_clust;		/* Last allocated cluster */
 	DWORD	free_clust;		/* Number of free clusters */
 #endif
+#if !_FS_READONLY && _USE_RECLAIM
+	DWORD	reclaim[_RECLAIM_QUEUE];	/* Start clusters of chains pending removal, in order (0:none) */
+	DWORD	vsn;			/* Volume serial number (pending chain kept on remount of same volume) */
+#endif
 #if _FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
 #endif
@@ -216,6 +220,10 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_lseek (FIL* fp, DWORD ofs);								/* Move file pointer of a file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate file */
+FRESULT f_cut (FIL* fp);											/* Truncate file, queueing removal of clusters */
+FRESULT f_extent (FIL* fp);											/* Set file size to the extent of its cluster chain */
+FRESULT f_reclaim (FATFS* fs, UINT ncl);							/* Remove clusters pending after f_cut */
+FRESULT f_erase (FIL* fp, DWORD ofs, UINT ncl, DWORD* next, DWORD* cur);	/* Pre-erase clusters of a file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of a writing file */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
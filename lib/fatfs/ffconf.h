@@ -15,7 +15,7 @@
 /  and optional writing functions as well. */
 
 
-#define _FS_MINIMIZE	2
+#define _FS_MINIMIZE	1
 /* This option defines minimization level to remove some basic API functions.
 /
 /   0: All basic functions are enabled.
@@ -39,11 +39,11 @@
 /  f_findfirst() and f_findnext(). (0:Disable or 1:Enable) */
 
 
-#define	_USE_MKFS		0
+#define	_USE_MKFS		1
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define	_USE_FASTSEEK	0
+#define	_USE_FASTSEEK	1
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 
@@ -57,6 +57,23 @@
 /  To enable it, also _FS_TINY need to be set to 1. */
 
 
+#define	_USE_RECLAIM	1
+/* This option switches deferred cluster removal, f_cut() and f_reclaim().
+/  f_cut() truncates a file like f_truncate() but only unlinks the remaining
+/  cluster chain, which is then freed in batches by f_reclaim().
+/  (0:Disable or 1:Enable) */
+
+#define	_RECLAIM_QUEUE	4
+/* Number of unlinked chains which may await removal by f_reclaim(). f_cut()
+/  returns FR_LOCKED while the queue is full. */
+
+
+#define	_USE_ERASE		1
+/* This option switches f_erase() function, which pre-erases clusters of a file
+/  (in contiguous runs) ahead of writing. CTRL_TRIM command must be implemented
+/  in the disk_ioctl() function. (0:Disable or 1:Enable) */
+
+
 /*---------------------------------------------------------------------------/
 / Locale and Namespace Configurations
 /---------------------------------------------------------------------------*/
@@ -12,6 +12,7 @@
 /-------------------------------------------------------------------------*/
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "diskio.h"
 
 // DEBUG
@@ -24,6 +25,7 @@
 #define MMC_WP		0						/* Write protected. yes:true, no:false, default:false */
 #define	FCLK_SLOW()	SPCR = 0x52				/* Set slow clock (F_CPU / 64) */
 #define	FCLK_FAST()	SPCR = 0x50				/* Set fast clock (F_CPU / 2) */
+#define CRC_RETRY	2						/* Retries of a transfer failing CRC (from the failed sector) */
 
 
 /*--------------------------------------------------------------------------
@@ -53,6 +55,7 @@
 #define CMD38	(38)		/* ERASE */
 #define CMD55	(55)		/* APP_CMD */
 #define CMD58	(58)		/* READ_OCR */
+#define CMD59	(59)		/* CRC_ON_OFF */
 
 
 static volatile
@@ -64,6 +67,35 @@ BYTE Timer1, Timer2;	/* 100Hz decrement timer */
 static
 BYTE CardType;			/* Card type flags */
 
+static
+DWORD BusyStat[3];		/* Busy statistics (waits, total polls, longest wait in polls) */
+
+static
+BYTE Programming;		/* A written block is being programmed (next wait counted in BusyStat) */
+
+static
+BYTE Erasing;			/* An erase (CMD38) may be in progress (next select waits longer) */
+
+static
+BYTE InitCmd;			/* Command polled by disk_poll (0:No initialization in progress) */
+
+static
+BYTE CrcOn;				/* Data block CRC enabled (MMC_SET_CRC) */
+
+static
+DWORD CrcErrors;		/* Data blocks failing CRC (received, or rejected by the card) */
+
+/* CRC16-CCITT (x^16+x^12+x^5+1) of one nibble, indexed by nibble ^ top nibble of CRC */
+static const
+WORD Crc16Tbl[16] PROGMEM = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+/* SD allocation unit sizes (sectors) of AU_SIZE codes 11-15, not powers of 2 from 12 MB */
+static const
+DWORD AuSize[5] PROGMEM = { 24576, 32768, 49152, 65536, 131072 };
+
 
 /*-----------------------------------------------------------------------*/
 /* Power Control  (Platform dependent)                                   */
@@ -127,6 +159,27 @@ void xmit_spi_multi (
 	} while (cnt -= 2);
 }
 
+/* Send a data block fast, computing its CRC16 while each byte is shifted out */
+static
+WORD xmit_spi_multi_crc (	/* Returns CRC16 of the block */
+	const BYTE *p,	/* Data block to be sent */
+	UINT cnt		/* Size of data block */
+)
+{
+	WORD crc = 0;
+	BYTE d;
+
+	do {
+		d = *p++;
+		SPDR = d;
+		crc = (crc << 4) ^ pgm_read_word(&Crc16Tbl[(crc >> 12) ^ (d >> 4)]);
+		crc = (crc << 4) ^ pgm_read_word(&Crc16Tbl[(crc >> 12) ^ (d & 0x0F)]);
+		loop_until_bit_is_set(SPSR,SPIF);
+	} while (--cnt);
+
+	return crc;
+}
+
 /* Receive a data block fast */
 static
 void rcvr_spi_multi (
@@ -142,6 +195,50 @@ void rcvr_spi_multi (
 
 
 
+/* Receive a data block fast, computing its CRC16 while the next byte is shifted in */
+static
+WORD rcvr_spi_multi_crc (	/* Returns CRC16 of the block (the CRC bytes follow) */
+	BYTE *p,	/* Data buffer */
+	UINT cnt	/* Size of data block */
+)
+{
+	WORD crc = 0;
+	BYTE d;
+
+	SPDR = 0xFF;
+	do {
+		loop_until_bit_is_set(SPSR,SPIF);
+		d = SPDR;
+		SPDR = 0xFF;	/* Next byte (the first CRC byte after the last data byte) */
+		*p++ = d;
+		crc = (crc << 4) ^ pgm_read_word(&Crc16Tbl[(crc >> 12) ^ (d >> 4)]);
+		crc = (crc << 4) ^ pgm_read_word(&Crc16Tbl[(crc >> 12) ^ (d & 0x0F)]);
+	} while (--cnt);
+	loop_until_bit_is_set(SPSR,SPIF);	/* First CRC byte left in SPDR */
+
+	return crc;
+}
+
+/* CRC7 of a command byte */
+static
+BYTE crc7 (
+	BYTE crc,	/* CRC of preceding bytes (0 at start of command) */
+	BYTE d		/* Command byte */
+)
+{
+	BYTE n;
+
+	for (n = 8; n; n--) {
+		crc <<= 1;
+		if ((d ^ crc) & 0x80) crc ^= 0x09;
+		d <<= 1;
+	}
+
+	return crc;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Wait for card ready                                                   */
 /*-----------------------------------------------------------------------*/
@@ -152,12 +249,23 @@ int wait_ready (	/* 1:Ready, 0:Timeout */
 )
 {
 	BYTE d;
+	DWORD n = 0;
 
 
 	Timer2 = wt / 10;
-	do
+	do {
 		d = xchg_spi(0xFF);
-	while (d != 0xFF && Timer2);
+		n++;
+	} while (d != 0xFF && Timer2);
+
+	if (Programming) {		/* Write busy only (not erase, nor other waits) */
+		Programming = 0;
+		if (n > 1) {		/* Card was busy programming the written block */
+			BusyStat[0]++;
+			BusyStat[1] += n;
+			if (n > BusyStat[2]) BusyStat[2] = n;
+		}
+	}
 
 	return (d == 0xFF) ? 1 : 0;
 }
@@ -186,7 +294,10 @@ int select (void)	/* 1:Successful, 0:Timeout */
 {
 	CS_LOW();		/* Set CS# low */
 	xchg_spi(0xFF);	/* Dummy clock (force DO enabled) */
-	if (wait_ready(500)) return 1;	/* Wait for card ready */
+	if (wait_ready(Erasing ? 2500 : 500)) {	/* Wait for card ready (erase may take longer) */
+		Erasing = 0;
+		return 1;
+	}
 
 	deselect();
 	return 0;	/* Timeout */
@@ -205,6 +316,7 @@ int rcvr_datablock (
 )
 {
 	BYTE token;
+	WORD crc, rcrc;
 
 
 	Timer1 = 20;
@@ -213,6 +325,17 @@ int rcvr_datablock (
 	} while ((token == 0xFF) && Timer1);
 	if (token != 0xFE) return 0;	/* If not valid data token, retutn with error */
 
+	if (CrcOn && btr == 512) {		/* Check CRC of sectors (not of partially read registers) */
+		crc = rcvr_spi_multi_crc(buff, btr);
+		rcrc = (WORD)SPDR << 8;			/* Received CRC (MSB first) */
+		rcrc |= xchg_spi(0xFF);
+		if (crc != rcrc) {				/* Block corrupted in transfer */
+			CrcErrors++;
+			return 0;
+		}
+		return 1;
+	}
+
 	rcvr_spi_multi(buff, btr);		/* Receive the data block into buffer */
 	xchg_spi(0xFF);					/* Discard CRC */
 	xchg_spi(0xFF);
@@ -234,19 +357,27 @@ int xmit_datablock (
 )
 {
 	BYTE resp;
+	WORD crc = 0xFFFF;
 
 
 	if (!wait_ready(500)) return 0;
 
 	xchg_spi(token);					/* Xmit data token */
 	if (token != 0xFD) {	/* Is data token */
-		xmit_spi_multi(buff, 512);		/* Xmit the data block to the MMC */
-		xchg_spi(0xFF);					/* CRC (Dummy) */
-		xchg_spi(0xFF);
+		if (CrcOn) {
+			crc = xmit_spi_multi_crc(buff, 512);	/* Xmit the data block, computing CRC */
+		} else {
+			xmit_spi_multi(buff, 512);	/* Xmit the data block to the MMC */
+		}
+		xchg_spi((BYTE)(crc >> 8));		/* CRC (Dummy where CRC is off) */
+		xchg_spi((BYTE)crc);
 		resp = xchg_spi(0xFF);			/* Reveive data response */
+		if ((resp & 0x1F) == 0x0B)		/* Rejected due to CRC error */
+			CrcErrors++;
 		if ((resp & 0x1F) != 0x05)		/* If not accepted, return with error */
 			return 0;
 	}
+	Programming = 1;	/* Busy while block is programmed (or, after a stop token, the last block) */
 
 	return 1;
 }
@@ -264,7 +395,7 @@ BYTE send_cmd (		/* Returns R1 resp (bit7==1:Send failed) */
 	DWORD arg		/* Argument */
 )
 {
-	BYTE n, res;
+	BYTE n, res, crc, buf[5];
 
 
 	if (cmd & 0x80) {	/* ACMD<n> is the command sequense of CMD55-CMD<n> */
@@ -279,16 +410,18 @@ BYTE send_cmd (		/* Returns R1 resp (bit7==1:Send failed) */
 		if (!select()) return 0xFF;
 	}
 
-	/* Send command packet */
-	xchg_spi(0x40 | cmd);				/* Start + Command index */
-	xchg_spi((BYTE)(arg >> 24));		/* Argument[31..24] */
-	xchg_spi((BYTE)(arg >> 16));		/* Argument[23..16] */
-	xchg_spi((BYTE)(arg >> 8));			/* Argument[15..8] */
-	xchg_spi((BYTE)arg);				/* Argument[7..0] */
-	n = 0x01;							/* Dummy CRC + Stop */
-	if (cmd == CMD0) n = 0x95;			/* Valid CRC for CMD0(0) + Stop */
-	if (cmd == CMD8) n = 0x87;			/* Valid CRC for CMD8(0x1AA) Stop */
-	xchg_spi(n);
+	/* Send command packet (with valid CRC7, required once CRC is enabled by CMD59) */
+	buf[0] = 0x40 | cmd;				/* Start + Command index */
+	buf[1] = (BYTE)(arg >> 24);			/* Argument[31..24] */
+	buf[2] = (BYTE)(arg >> 16);			/* Argument[23..16] */
+	buf[3] = (BYTE)(arg >> 8);			/* Argument[15..8] */
+	buf[4] = (BYTE)arg;					/* Argument[7..0] */
+	crc = 0;
+	for (n = 0; n < 5; n++) {
+		xchg_spi(buf[n]);
+		crc = crc7(crc, buf[n]);
+	}
+	xchg_spi((crc << 1) | 1);			/* CRC7 + Stop */
 
 	/* Receive command response */
 	if (cmd == CMD12) xchg_spi(0xFF);		/* Skip a stuff byte when stop reading */
@@ -320,6 +453,9 @@ DSTATUS disk_initialize (
 	BYTE n, cmd, ty, ocr[4];
 
 	if (pdrv) return STA_NOINIT;		/* Supports only single drive */
+	if (!(Stat & STA_NOINIT)) return Stat;	/* Already initialized (disk_start/disk_poll) */
+	InitCmd = 0;						/* Abandon deferred initialization */
+	CrcOn = 0;							/* CRC is off after reset (CMD0) */
 	power_off();						/* Turn off the socket power to reset the card */
 	if (Stat & STA_NODISK) return Stat;	/* No card in the socket */
 	power_on();							/* Turn on the socket power */
@@ -364,6 +500,106 @@ DSTATUS disk_initialize (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Start Deferred Initialization of Disk Drive                           */
+/*-----------------------------------------------------------------------*/
+/* Issues CMD0/CMD8 and returns, the card leaving idle state is then     */
+/* polled by disk_poll (one ACMD41/CMD1 per call) from the main loop.    */
+
+DSTATUS disk_start (
+	BYTE pdrv		/* Physical drive nmuber (0) */
+)
+{
+	BYTE n, ocr[4];
+
+	if (pdrv) return STA_NOINIT;		/* Supports only single drive */
+	InitCmd = 0;
+	CrcOn = 0;							/* CRC is off after reset (CMD0) */
+	Stat |= STA_NOINIT;
+	power_off();						/* Turn off the socket power to reset the card */
+	if (Stat & STA_NODISK) return Stat;	/* No card in the socket */
+	power_on();							/* Turn on the socket power */
+	FCLK_SLOW();
+	for (n = 10; n; n--) xchg_spi(0xFF);	/* 80 dummy clocks */
+
+	CardType = 0;
+	if (send_cmd(CMD0, 0) == 1) {			/* Enter Idle state */
+		Timer1 = 100;						/* Initialization timeout of 1000 msec */
+		if (send_cmd(CMD8, 0x1AA) == 1) {	/* SDv2? */
+			for (n = 0; n < 4; n++) ocr[n] = xchg_spi(0xFF);		/* Get trailing return value of R7 resp */
+			if (ocr[2] == 0x01 && ocr[3] == 0xAA) {				/* The card can work at vdd range of 2.7-3.6V */
+				CardType = CT_SD2; InitCmd = ACMD41;			/* Poll ACMD41 with HCS bit */
+			}
+		} else {							/* SDv1 or MMCv3 */
+			if (send_cmd(ACMD41, 0) <= 1) 	{
+				CardType = CT_SD1; InitCmd = ACMD41;	/* SDv1 */
+			} else {
+				CardType = CT_MMC; InitCmd = CMD1;	/* MMCv3 */
+			}
+		}
+	}
+	deselect();
+
+	if (!InitCmd) {			/* Initialization failed */
+		CardType = 0;
+		power_off();
+	}
+
+	return Stat;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Continue Deferred Initialization of Disk Drive                        */
+/*-----------------------------------------------------------------------*/
+/* Returns 1 while initialization is in progress, otherwise 0 (success   */
+/* is then indicated by STA_NOINIT being cleared in disk_status)         */
+
+int disk_poll (
+	BYTE pdrv		/* Physical drive nmuber (0) */
+)
+{
+	BYTE n, ty, ocr[4];
+
+	if (pdrv || !InitCmd) return 0;
+
+	ty = CardType;
+	if (Timer1) {
+		if (send_cmd(InitCmd, (ty & CT_SD2) ? 1UL << 30 : 0)) {	/* Still in idle state? */
+			deselect();
+			return 1;
+		}
+		if (ty & CT_SD2) {
+			if (send_cmd(CMD58, 0) == 0) {		/* Check CCS bit in the OCR */
+				for (n = 0; n < 4; n++) ocr[n] = xchg_spi(0xFF);
+				if (ocr[0] & 0x40) ty |= CT_BLOCK;	/* SDv2 (block addressing) */
+			} else {
+				ty = 0;
+			}
+		} else {
+			if (send_cmd(CMD16, 512) != 0)		/* Set R/W block length to 512 */
+				ty = 0;
+		}
+	} else {				/* Timeout */
+		ty = 0;
+	}
+	InitCmd = 0;
+	CardType = ty;
+	deselect();
+
+	if (ty) {			/* Initialization succeded */
+		Stat &= ~STA_NOINIT;		/* Clear STA_NOINIT */
+		FCLK_FAST();
+	} else {			/* Initialization failed */
+		power_off();
+	}
+
+	return 0;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Disk Status                                                       */
 /*-----------------------------------------------------------------------*/
@@ -389,7 +625,8 @@ DRESULT disk_read (
 	UINT count			/* Sector count (1..128) */
 )
 {
-	BYTE cmd;
+	BYTE cmd, retry = CRC_RETRY;
+	DWORD errors;
 
 
 	if (pdrv || !count) return RES_PARERR;
@@ -397,15 +634,20 @@ DRESULT disk_read (
 
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
 
-	cmd = count > 1 ? CMD18 : CMD17;			/*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
-	if (send_cmd(cmd, sector) == 0) {
-		do {
-			if (!rcvr_datablock(buff, 512)) break;
-			buff += 512;
-		} while (--count);
-		if (cmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
+	for (;;) {
+		errors = CrcErrors;
+		cmd = count > 1 ? CMD18 : CMD17;			/*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
+		if (send_cmd(cmd, sector) == 0) {
+			do {
+				if (!rcvr_datablock(buff, 512)) break;
+				buff += 512;
+				sector += (CardType & CT_BLOCK) ? 1 : 512;
+			} while (--count);
+			if (cmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
+		}
+		deselect();
+		if (!count || CrcErrors == errors || !retry--) break;	/* Retry from the sector failing CRC */
 	}
-	deselect();
 
 	return count ? RES_ERROR : RES_OK;
 }
@@ -424,29 +666,38 @@ DRESULT disk_write (
 	UINT count			/* Sector count (1..128) */
 )
 {
+	BYTE retry = CRC_RETRY;
+	DWORD errors;
+
+
 	if (pdrv || !count) return RES_PARERR;
 	if (Stat & STA_NOINIT) return RES_NOTRDY;
 	if (Stat & STA_PROTECT) return RES_WRPRT;
 
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
 
-	if (count == 1) {	/* Single block write */
-		if ((send_cmd(CMD24, sector) == 0)	/* WRITE_BLOCK */
-			&& xmit_datablock(buff, 0xFE))
-			count = 0;
-	}
-	else {				/* Multiple block write */
-		if (CardType & CT_SDC) send_cmd(ACMD23, count);
-		if (send_cmd(CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
-			do {
-				if (!xmit_datablock(buff, 0xFC)) break;
-				buff += 512;
-			} while (--count);
-			if (!xmit_datablock(0, 0xFD))	/* STOP_TRAN token */
-				count = 1;
+	for (;;) {
+		errors = CrcErrors;
+		if (count == 1) {	/* Single block write */
+			if ((send_cmd(CMD24, sector) == 0)	/* WRITE_BLOCK */
+				&& xmit_datablock(buff, 0xFE))
+				count = 0;
 		}
+		else {				/* Multiple block write */
+			if (CardType & CT_SDC) send_cmd(ACMD23, count);
+			if (send_cmd(CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
+				do {
+					if (!xmit_datablock(buff, 0xFC)) break;
+					buff += 512;
+					sector += (CardType & CT_BLOCK) ? 1 : 512;
+				} while (--count);
+				if (!xmit_datablock(0, 0xFD) && !count)	/* STOP_TRAN token */
+					count = 1;
+			}
+		}
+		deselect();
+		if (!count || CrcErrors == errors || !retry--) break;	/* Retry from the block rejected for CRC */
 	}
-	deselect();
 
 	return count ? RES_ERROR : RES_OK;
 }
@@ -466,7 +717,7 @@ DRESULT disk_ioctl (
 {
 	DRESULT res;
 	BYTE n, csd[16], *ptr = buff;
-	DWORD csize;
+	DWORD csize, *dp, st, ed;
 
 
 	if (pdrv) return RES_PARERR;
@@ -500,7 +751,8 @@ DRESULT disk_ioctl (
 				xchg_spi(0xFF);
 				if (rcvr_datablock(csd, 16)) {				/* Read partial block */
 					for (n = 64 - 16; n; n--) xchg_spi(0xFF);	/* Purge trailing data */
-					*(DWORD*)buff = 16UL << (csd[10] >> 4);
+					n = csd[10] >> 4;	/* AU_SIZE */
+					*(DWORD*)buff = (n <= 10) ? 16UL << n : pgm_read_dword(&AuSize[n - 11]);
 					res = RES_OK;
 				}
 			}
@@ -516,6 +768,20 @@ DRESULT disk_ioctl (
 		}
 		break;
 
+	case CTRL_TRIM :		/* Erase a block of sectors (DWORD[2]: start, end sector) */
+		if (!(CardType & CT_SDC)) break;				/* Check if the card is SDC */
+		if ((send_cmd(CMD9, 0) != 0) || !rcvr_datablock(csd, 16)) break;	/* Get CSD */
+		if (!(csd[0] >> 6) && !(csd[10] & 0x40)) break;	/* Check if sector erase can be applied to the card */
+		dp = buff; st = dp[0]; ed = dp[1];				/* Load sector block */
+		if (!(CardType & CT_BLOCK)) {
+			st *= 512; ed *= 512;
+		}
+		if (send_cmd(CMD32, st) == 0 && send_cmd(CMD33, ed) == 0 && send_cmd(CMD38, 0) == 0) {	/* Erase sector block */
+			Erasing = 1;	/* Not waited for here (see MMC_GET_READY) */
+			res = RES_OK;
+		}
+		break;
+
 	/* Following commands are never used by FatFs module */
 
 	case MMC_GET_TYPE :		/* Get card type flags (1 byte) */
@@ -550,6 +816,36 @@ DRESULT disk_ioctl (
 		}
 		break;
 
+	case MMC_GET_READY :	/* Check card is ready, without waiting (1 byte: 1 ready, 0 busy) */
+		CS_LOW();
+		xchg_spi(0xFF);
+		*ptr = (xchg_spi(0xFF) == 0xFF);
+		if (*ptr) Erasing = 0;
+		res = RES_OK;
+		break;
+
+	case MMC_GET_BUSY :		/* Get busy statistics (DWORD[3]: waits, polls, longest), then clear */
+		dp = buff;
+		for (n = 0; n < 3; n++) {
+			dp[n] = BusyStat[n];
+			BusyStat[n] = 0;
+		}
+		res = RES_OK;
+		break;
+
+	case MMC_SET_CRC :		/* Enable/disable CRC of data blocks (1 byte: 1 on, 0 off) */
+		if (send_cmd(CMD59, *ptr ? 1 : 0) == 0) {	/* CRC_ON_OFF */
+			CrcOn = *ptr ? 1 : 0;
+			res = RES_OK;
+		}
+		break;
+
+	case MMC_GET_CRCERR :	/* Get count of data blocks failing CRC (DWORD), then clear */
+		*(DWORD*)buff = CrcErrors;
+		CrcErrors = 0;
+		res = RES_OK;
+		break;
+
 	case CTRL_POWER_OFF :	/* Power off */
 		power_off();
 		Stat |= STA_NOINIT;
@@ -2,7 +2,9 @@
  /* INCLUDED LIBRARIES/HEADER FILES                                      */
  /************************************************************************/
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include <stdio.h>
 
@@ -11,7 +13,13 @@
 #include "wave.h"
 #include "buffer.h"
 #include "adc.h"
+#include "dsp.h"
+#include "meter.h"
+#include "codec.h"
+#include "store.h"
+#include "sched.h"
 #include "lib/fatfs/diskio.h"
+#include "lib/usb_serial/usb_serial.h"
 /************************************************************************/
 /* ENUM DEFINITIONS                                                     */
 /************************************************************************/
@@ -24,18 +32,87 @@ enum {
 /************************************************************************/
 /* GLOBAL VARIABLES                                                     */
 /************************************************************************/
-volatile uint16_t countpage = 0;
 uint16_t pageCount = 0;	// Page counter - used to terminate recording
-uint16_t newPage = 0;	// Flag that indicates a new page is available for read/write
-uint8_t stop = 0;		// Flag that indicates playback/recording is complete
+uint8_t state = DVR_STOPPED;	// State of DVR state machine
+uint8_t pb_prev = 0x00;		// Debounced pushbutton state at last button event
+uint16_t latency_max = 0;	// Worst-case button-to-action latency (ticks) during a take
+uint16_t start_latency = 0;	// Time from record button press (or command) to start of sampling (ticks)
+uint16_t write_pages = 0;	// Pages written to SD card during a take
+uint32_t write_ticks = 0;	// Total time writing pages during a take (ticks)
+uint16_t write_max = 0;		// Longest page write during a take (ticks)
+volatile uint16_t pages_filled = 0;	// Pages filled by the ADC during a take
+uint16_t button_latency = 0;	// Time from debounced edge to handling of current button event (ticks)
+uint8_t button_event = 0;	// Flag to indicate current action is from a pushbutton (not the console)
+uint8_t confirm_cmd = 0;	// Console command awaiting confirmation (format, clear log)
+uint8_t store_mode = 0;		// Flag to record to raw log store rather than WAVE file
+uint8_t crc_mode = 0;		// Flag to enable CRC of SD card transfers (integrity mode)
+uint8_t meter_live = 0;		// Flag to enable live level output on the console
+uint8_t meter_pages = 0;	// Pages metered since last live level output
+uint32_t clip_total = 0;	// Clipped conversions in current take
+uint16_t clip_first = 0;	// Page of first clipped conversion
+uint16_t clip_last = 0;		// Page of last clipped conversion
+uint64_t noise_power = 0;	// Sum of squared deviations from page means in current take (noise floor)
+uint16_t noise_pages = 0;	// Pages summed into noise_power
+uint8_t codec_enabled = 0;	// Flag to record using lossless codec
+uint8_t stereo = 0;			// Flag to record two channels (ADC0 left, ADC1 right)
+uint8_t playlist = 0;		// Flag to play all WAVE files (gapless) rather than the last take
+uint32_t play_position = 0;	// Next sample (frame) to be read from the file being played
+
+#define STACK_PAINT	0xC5		// Pattern filling unused RAM at boot (stack headroom)
+#define STACK_MARGIN	16		// Bytes below the stack pointer left unpainted (frame of stack_paint)
+
+extern uint8_t __heap_start;	// End of static data (linker, no heap in use)
+
+#define SEEK_STEP	78125UL		// Samples skipped by seek commands (5 s, half as many stereo frames)
 volatile uint8_t overflow_counter = 0;
 volatile uint8_t overflow_reset  = 2;
 
+// Playback volume (gain in 1/128 steps, approx. 3 dB apart, 128 = unity)
+#define VOLUME_STEPS	12
+const uint8_t volume_gain[VOLUME_STEPS] PROGMEM = {0, 4, 6, 8, 11, 16, 23, 32, 45, 64, 90, 128};
+uint8_t volume = VOLUME_STEPS - 1;		// Volume step (index into volume_gain)
+volatile uint8_t gain = 128;			// Gain applied to playback samples (ramps toward gain_target)
+volatile uint8_t gain_target = 128;		// Gain for selected volume step
+
+// Dual PWM output: the high byte of a 16-bit sample drives OC1B (PB6, as in
+// single output) and the low byte OC1A (PB5). Timer1 TOP is held in ICR1 so
+// that OCR1A is free as a compare channel (PB7, OC1C, is SD card chip select).
+// The outputs are summed through resistors in the ratio 1:256 (e.g. 1k on PB6,
+// 256k on PB5, into the output filter), so OC1A adds up to one step of OC1B in
+// 256 sub-steps.
+uint8_t pwm_dual = 0;		// Flag to enable dual PWM (16-bit) output
+
+// Noise shaping of 8-bit output: the volume-scaled sample (15 bits) is truncated
+// to 8 bits with the truncation error fed back into following samples, moving
+// the error (and distortion at low levels) toward high frequencies where the
+// output filter and ear are less sensitive. First order shapes by (1 - z^-1),
+// second order by (1 - z^-1)^2.
+// Only 8-bit WAVE files are recorded and played, so the higher-resolution
+// source is this volume-scaled product, not 10- or 16-bit material: the shaper
+// acts below unity volume only (no fraction at unity), and not on dual PWM
+// output (low byte carried by OC1A). In-band SNR of a host render of this
+// requantiser (off / first / second order, 1 kHz -2 dBFS tone, error in
+// 0-3.4 kHz, see tools/ns_render.py): 41.5/48.8/49.2 dB at gain 64,
+// 25.3/34.6/36.3 dB at gain 16, 16.1/29.1/27.8 dB at gain 6.
+uint8_t ns_order = 0;		// Noise shaping order (0 = plain truncation, 1 or 2)
+int16_t ns_feedback = 0;	// Error fed back into next sample (Q7)
+uint8_t ns_last = 0;		// Truncation error of previous sample (Q7)
+
 /************************************************************************/
 /* FUNCTION PROTOTYPES                                                  */
 /************************************************************************/
 void pageFull();
 void pageEmpty();
+void dvr_stop();
+void task_meter();
+void PWM_stop();
+void volume_set(int8_t step);
+void play_seek(int8_t direction);
+uint16_t crc_readTicks();
+void crc_set(uint8_t enable);
+void record_mark(uint16_t age);
+void play_cue(uint8_t number);
+void task_console();
 
 /************************************************************************/
 /* INITIALISATION FUNCTIONS                                             */
@@ -61,6 +138,7 @@ void init() {
 	pll_init();     // Configure PLL (used by Timer4 and USB serial)
 	serial_init();	// Initialise USB serial interface (debug)
 	timer_init();	// Initialise timer (used by FatFs library)
+	sched_init();	// Initialise scheduler (events posted by buffer callbacks/timer)
 	buffer_init(pageFull, pageEmpty);  // Initialise circular buffer (must specify callback functions)
 	adc_init();		// Initialise ADC
 	//userio_init();  // Initialise LEDs
@@ -70,7 +148,7 @@ DDRF &= 0b10001111;    // Pushbuttons 1 to 3 - PORTF 6-4 as inputs
 DDRD |= 0b11110000;		// Set PORTD 7-4 as outputs (LEDs)
 	
 	// Must be called after interrupts are enabled
-	wave_init();	// Initialise WAVE file interface
+	wave_init();	// Initialise WAVE file interface (card initialised in idle time)
 }
 
 /************************************************************************/
@@ -79,41 +157,166 @@ DDRD |= 0b11110000;		// Set PORTD 7-4 as outputs (LEDs)
 
 // CALLED FROM BUFFER MODULE WHEN A PAGE IS FILLED WITH RECORDED SAMPLES
 void pageFull() {
+	pages_filled++;
+	dsp_page();		// Update AGC gain once per page
+	meter_page();	// Latch level measurements of this page
+	
 	if(!(--pageCount)) {
 		// If all pages have been read
 		adc_stop();		// Stop recording (disable new ADC conversions)
-		stop = 1;		// Flag recording complete
+		sched_post(SCHED_EVT_STOP);	// Flag recording complete
 	} else {
-		newPage = 1;	// Flag new page is ready to write to SD card
+		sched_post(SCHED_EVT_PAGE);	// Flag new page is ready to write to SD card
 	}
 }
 
 // CALLED FROM BUFFER MODULE WHEN A NEW PAGE HAS BEEN EMPTIED
+// (pageCount is zero until the end of the audio data has been read)
 void pageEmpty() {
-	// TODO: Implement code to handle "page empty" callback 
-	if(!(--pageCount)) //If all pages have been read
-		stop = 1;
+	if(pageCount && !(--pageCount)) //If all pages have been read
+		sched_post(SCHED_EVT_STOP);
 	else
-		newPage = 1;  // Flag new page is ready to write to SD card
+		sched_post(SCHED_EVT_PAGE);  // Flag new page is ready to read from SD card
 }
 
 /************************************************************************/
 /* RECORD/PLAYBACK ROUTINES                                             */
 /************************************************************************/
 
-// Initiates a record cycle
-void dvr_record() {
+// Writes a full page of recorded samples to the SD card (encoding if enabled)
+void write_page(uint8_t* pPage) {
+	uint16_t start = timer_now();
+	uint16_t ticks;
+	
+	if (store_mode) {
+		if (!store_write(pPage)) {
+			// Log full, finish recording
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				pageCount = 1;
+			}
+		}
+	} else {
+		if (wave_segmentDue()) wave_rollover();	// Continue in next file (between pages/blocks)
+		
+		if (wave_audioFormat() == WAVE_FORMAT_DRICE) {
+			codec_encode(pPage);
+		} else {
+			wave_write(pPage, 512);
+		}
+		wave_page(meter_pagePairs(write_pages));	// Checksum and overview of page (sidecar)
+	}
+	
+	// Write time statistics (throughput of card layout)
+	ticks = timer_now() - start;
+	write_pages++;
+	write_ticks += ticks;
+	if (ticks > write_max) write_max = ticks;
+}
+
+// Reads a full page of samples for playback from the SD card (decoding if required)
+// Returns the number of samples read (less than 512 at end of audio data)
+// During playlist playback a file ending within the page does not end playback
+uint16_t read_page(uint8_t* pPage) {
+	uint16_t count;
+	
+	do {
+		wave_advance();		// Next file of playlist (at end of current file)
+		
+		if (wave_audioFormat() == WAVE_FORMAT_DRICE) {
+			count = codec_decode(pPage);
+		} else {
+			count = wave_read(pPage, 512);
+		}
+	} while (!count && wave_listContinue());	// File ended on a page boundary
+	
+	if ((count < 512) && wave_listContinue()) {
+		// PCM continues from a following PCM file, otherwise the rest of the
+		// page is silence (an encoded file starts with the next page)
+		wave_read(pPage + count, 512 - count);
+		count = 512;
+	}
+	
+	play_position += count / wave_numChannels();
+	return count;
+}
+
+// Fills RAM between the end of static data and the stack with STACK_PAINT (call first at boot)
+void stack_paint() {
+	uint8_t* p = &__heap_start;
+	
+	while (p < (uint8_t*)SP - STACK_MARGIN) *p++ = STACK_PAINT;
+}
+
+// Returns the bytes of RAM never reached by the stack since boot (deepest ISR and call chain so far)
+uint16_t stack_free() {
+	uint8_t* p = &__heap_start;
+	
+	while ((*p == STACK_PAINT) && (p < (uint8_t*)SP)) p++;
+	return p - &__heap_start;
+}
+
+// Integer square root of a 32-bit value
+uint16_t isqrt32(uint32_t x) {
+	uint16_t r = 0;
+	
+	for (uint16_t bit = 0x8000; bit; bit >>= 1) {
+		uint16_t t = r | bit;
+		if ((uint32_t)t * t <= x) r = t;
+	}
+	
+	return r;
+}
+
+// Returns a 512 byte work area for SD card access (a buffer page, only while stopped)
+uint8_t* work_page() {
+	return buffer_writePage();
+}
+
+// Initiates a record cycle, returns zero where recording cannot start
+uint8_t dvr_record() {
+	uint16_t start = timer_now();
+	uint32_t busy[3];
+	
+	// From a pushbutton, measure from the press: the debounced edge (pb_timestamp)
+	// follows the first sample of the press by two debounce intervals
+	if (button_event) start -= button_latency + 2 * TIMER_INTERVAL_DEBOUNCE;
+	
+	if (store_mode && !store_create()) {
+		printf_P(PSTR("Log full!\n"));
+		return 0;
+	}
+	
 	buffer_reset();		// Reset buffer state
-	countpage = 0;
-	pageCount = 305;	// Maximum record time of 10 sec
-	newPage = 0;		// Clear new page flag
+	pages_filled = 0;
+	pageCount = (waveSegment && !store_mode) ? 0xFFFF : 305;	// Maximum record time of 10 sec (35 min in segments)
+	sched_cancel(SCHED_EVT_PAGE);	// Clear new page flag
+	write_pages = 0;
+	write_ticks = 0;
+	write_max = 0;
+	disk_ioctl(0, MMC_GET_BUSY, busy);	// Clear card busy statistics
 	
-	wave_create();		// Create new wave file on the SD card
+	// Stereo only to WAVE files, and uncompressed (codec predicts from the previous sample)
+	adc_channels((stereo && !store_mode) ? 2 : 1);
+	if (!store_mode) {
+		store_exportSuspend();	// Export file structure is used by recording
+		wave_channels(adc_nch);
+		wave_format((codec_enabled && (adc_nch == 1)) ? WAVE_FORMAT_DRICE : WAVE_FORMAT_PCM);
+		wave_create();		// Create new wave file on the SD card
+	}
+	codec_reset();		// Reset compression statistics
+	meter_reset();		// Reset level measurements
+	clip_total = 0;
+	noise_power = 0;
+	noise_pages = 0;
+	dsp_config(dsp_flags);	// Reset record DSP state
 	adc_start();		// Begin sampling
+	start_latency = timer_now() - start;
 
 	// TODO: Add code to handle LEDs
 	PORTD &= 0b10001111; // all LEDs off state
 	PORTD |= (1<<PIND5);
+	
+	return 1;
 }
 
 // TODO: Implement code to initiate playback and to stop recording/playback.
@@ -129,23 +332,133 @@ void PWM_init() {
 	DDRF &= 0b10001111;    // Pushbuttons 1 to 3 - PORTF 6-4 as inputs
 	DDRD |= 0b11110000;		// Set PORTD 7-4 as outputs (LEDs)
 	DDRB |= 0b01000000;	   // JOUT - PORTB 6 as an output
+	if (pwm_dual) DDRB |= 0b00100000;	// JOUT low byte - PORTB 5 as an output
+	else DDRB &= 0b11011111;			// PORTB 5 high impedance (no effect on output)
 
-OCR1A = 511;       //TOP, 15.625kHz
+ICR1 = 511;       //TOP, 15.625kHz
 OCR1B = 512*0.5;        //50% duty cycle
 TIMSK1 |= 0b00000001; //Enable overflow interrupt
-TCCR1A = 0b00100011; //Fast PWM (TOP = OCR1A) set OC1B on TOP, reset on CMP
-TCCR1B = 0b00011001; //Fast PWM (TOP = OCR1A), /1 prescaler
+TCCR1A = 0b00100010; //Fast PWM (TOP = ICR1) set OC1B on TOP, reset on CMP
+TCCR1B = 0b00011001; //Fast PWM (TOP = ICR1), /1 prescaler
+ns_feedback = 0;	// Reset noise shaper state
+ns_last = 0;
+if (pwm_dual) {
+	OCR1A = 0;
+	TCCR1A |= 0b10000000;	// Set OC1A on TOP, reset on CMP (low byte)
+}
 TCNT1 = 0x00;  // reset timer
 
-serial_init();	// Initialise USB serial interface (debug)
-
 sei();
 }
 
+// Selects playback volume step (clamped to valid range)
+// The ISR ramps the applied gain toward the new value to avoid clicks
+void volume_set(int8_t step) {
+	if (step < 0) step = 0;
+	if (step >= VOLUME_STEPS) step = VOLUME_STEPS - 1;
+	
+	volume = step;
+	gain_target = pgm_read_byte(&volume_gain[step]);
+	printf_P(PSTR("Volume: %u/%u\n"), volume, VOLUME_STEPS - 1);
+}
+
+// Returns the playback position in ms (each sample of a frame is played for one 64 us tick)
+uint32_t play_ms() {
+	return (play_position * wave_numChannels() * 64) / 1000;
+}
+
+// Skips playback forward/back by SEEK_STEP (takes effect after the pages already buffered)
+// Encoded takes resume from the nearest seek table entry before the target
+void play_seek(int8_t direction) {
+	uint32_t target = play_position;
+	uint32_t step;
+	
+	// Not during playlist playback, nor once the end of data has been read
+	if ((state != DVR_PLAYING) || playlist || pageCount) return;
+	
+	step = SEEK_STEP / wave_numChannels();	// Whole frames
+	if (direction > 0) {
+		target += step;
+	} else {
+		target = (target > step) ? target - step : 0;
+	}
+	
+	play_position = wave_seek(target);
+	printf_P(PSTR("Position: %lu ms\n"), play_ms());
+}
+
+// Drops a marker at the current recording position, less the age of the event (ticks)
+// The timer tick (64 us) equals the conversion period, so the age is subtracted directly
+// Markers are positioned in frames (one sample of each channel)
+void record_mark(uint16_t age) {
+	uint32_t position;
+	uint8_t number;
+	
+	if ((state != DVR_RECORDING) || store_mode) return;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		position = (uint32_t)pages_filled * 512 + buffer_writeIndex();
+	}
+	position = (position > age) ? position - age : 0;
+	
+	number = wave_mark(position / adc_nch);
+	if (number) {
+		printf_P(PSTR("Marker %u: %lu ms\n"), number, (position * 64) / 1000);
+	} else {
+		printf_P(PSTR("Markers full!\n"));
+	}
+}
+
+// Continues playback from a marker of the take being played
+void play_cue(uint8_t number) {
+	uint32_t target;
+	
+	// Not during playlist playback, nor once the end of data has been read
+	if ((state != DVR_PLAYING) || playlist || pageCount) return;
+	
+	if (!wave_cue(number, &target)) {
+		printf_P(PSTR("No marker %u\n"), number);
+		return;
+	}
+	
+	play_position = wave_seek(target);
+	printf_P(PSTR("Marker %u: %lu ms\n"), number, play_ms());
+}
+
+// Returns the time to read 32 sectors (start of card) in the current CRC mode (ticks)
+uint16_t crc_readTicks() {
+	uint8_t* pWork = work_page();
+	uint16_t start = timer_now();
+	
+	for (uint8_t i = 0; i < 32; i++) disk_read(0, pWork, i, 1);
+	
+	return (timer_now() - start) | 1;	// Non-zero
+}
+
+// Enables/disables CRC of SD card transfers, measuring the time to read
+// sectors in both modes so the cost of CRC per sector is reported directly
+void crc_set(uint8_t enable) {
+	uint16_t before = crc_readTicks();
+	uint16_t ticks;
+	
+	if (disk_ioctl(0, MMC_SET_CRC, &enable)) {
+		printf_P(PSTR("CRC not supported!\n"));
+		return;
+	}
+	crc_mode = enable;
+	ticks = crc_readTicks();
+	
+	printf_P(PSTR("CRC: %u, sector read %lu us (%lu KB/s), was %lu us, CRC cost %ld us per sector read\n"), crc_mode,
+		((uint32_t)ticks * TIMER_TICK_US) / 32, (32UL * 7812) / ticks,	// 512 B / 64 us = 7812 KB/s per tick
+		((uint32_t)before * TIMER_TICK_US) / 32,
+		(((int32_t)ticks - before) * (crc_mode ? TIMER_TICK_US : -TIMER_TICK_US)) / 32);
+}
+
 void PWM_stop(){
 		TCCR1A = 0;
 		TIMSK1 = 0;
 		OCR1B = 0;
+		OCR1A = 0;
 		TCNT1 = 0;
 }
 
@@ -153,8 +466,33 @@ ISR(TIMER1_OVF_vect) {
 	overflow_counter++;
 	
 	if (overflow_counter == overflow_reset) {
-	uint8_t output = buffer_dequeue();		//dequeue here
-	OCR1B = output ;
+	int8_t output = buffer_dequeue() - 0x80;		//dequeue here (signed about midpoint)
+	
+	// Ramp gain one step per sample toward target (no step change in output)
+	if (gain < gain_target) gain++;
+	else if (gain > gain_target) gain--;
+	
+	int16_t scaled = (int16_t)output * gain;	// Scale (8x8 hardware multiply), 15-bit
+	
+	if (pwm_dual) {
+		// Split 16-bit offset binary sample across both channels (byte moves)
+		uint16_t sample = 0x8000 + ((uint16_t)scaled << 1);
+		OCR1B = sample >> 8;
+		OCR1A = sample & 0xFF;
+	} else {
+		// Requantise to 8 bits (shifts and adds only, see ns_order)
+		int16_t level = scaled + ns_feedback;
+		uint8_t error = level & 0x7F;	// Truncated fraction (Q7)
+		
+		level >>= 7;
+		if (level > 127) level = 127;
+		else if (level < -128) level = -128;
+		OCR1B = 0x80 + level;
+		
+		if (ns_order == 2) ns_feedback = (error << 1) - ns_last;
+		else if (ns_order) ns_feedback = error;
+		ns_last = error;
+	}
 	overflow_counter =0;
 	
 	}
@@ -162,139 +500,494 @@ ISR(TIMER1_OVF_vect) {
 
 }//ISR
 
-void playback() {
+// Initiates playback (of last take, or of all files where playlist is enabled)
+// Returns zero if there is nothing to play
+uint8_t playback() {
+	uint16_t count;
+	
 	buffer_reset();
-	pageCount = countpage;
 	
 	overflow_reset = 2;
 	overflow_counter = 0;
+	pageCount = 0;		// End of audio data not yet known
+	play_position = 0;
+	
+	store_exportSuspend();	// Export file structure is used by playlist
+	if (!(playlist ? wave_openList() : wave_open())) {
+		wave_close();	// Nothing to play
+		return 0;
+	}
+	
 	PORTD |= 0b00010000;
-	wave_open();
-	wave_read(buffer_writePage(), 1024);
-	newPage = 0;
+	
+	// Fill both pages (write pointer returns to Page 0)
+	if (read_page(buffer_writePage()) < 512) {
+		pageCount = 1;	// All audio data in Page 0
+		read_page(buffer_writePage());
+	} else if ((count = read_page(buffer_writePage())) < 512) {
+		pageCount = count ? 2 : 1;	// Audio data ends in Page 1 (or Page 0)
+	}
+	sched_cancel(SCHED_EVT_PAGE);
 	PWM_init();
+	
+	return 1;
 }
 
 
 
 /************************************************************************/
-/* MAIN LOOP (CODE ENTRY)                                               */
+/* EVENT HANDLERS (DISPATCHED FROM SCHEDULER)                           */
 /************************************************************************/
-int main(void) {
+
+// Performs the action associated with newly pressed pushbuttons (or console commands)
+void dvr_action(uint8_t pb_rise) {
+	// Switch depending on state
+	switch (state) {
+		case DVR_STOPPED:
+		if ((pb_rise & ((1<<PINF4)|(1<<PINF5))) && (waveCard != WAVE_CARD_READY)) {
+			// SD card not yet initialised (retry where initialisation failed)
+			printf_P(PSTR("SD card not ready!\n"));
+			if (waveCard == WAVE_CARD_FAILED) wave_init();
+			break;
+		}
+		
+		//S1 pressed
+		if (pb_rise & (1<<PINF4))
+		{
+			printf_P(PSTR("Begin Playback..."));	// Output status to console
+			if (!playback()) {
+				printf_P(PSTR("No recording!\n"));
+				break;
+			}
+			state = DVR_PLAYING;
+			PORTD &= 0b10001111; // all LEDs off state
+			PORTD |= (1<<PIND4); // LED1 on
+		} 
+		else if (pb_rise & (1<<PINF5))
+		{
+			//S2 pressed
+			latency_max = 0;		// Measure button latency over this take
+			if (!dvr_record()) break;	// Initiate recording
+			state = DVR_RECORDING;
+			PORTD &= 0b10001111; // all LEDs off state
+			PORTD |= (1<<PIND5);  // LED2 on
+			printf_P(PSTR("Recording..."));
+		}
+		break;
+		case DVR_RECORDING:
+		if (pb_rise & (1<<PINF4))
+		{
+			//S1 pressed, drop marker (at time of press)
+			record_mark(button_latency);
+		}
+		if (pb_rise & (1<<PINF6))
+		{
+			//S3 pressed
+			PORTD &= 0b10001111; // all LEDs off state
+			PORTD |= (1<<PIND6);  //LED3 on
+			
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				pageCount = 1;	// Finish recording last page
+			}
+		}
+		break;
+		case DVR_PLAYING:
+		if (pb_rise & (1<<PINF6))
+		{
+			//S3 pressed
+			dvr_stop();
+		}
+		else if (pb_rise & (1<<PINF4))
+		{
+			//S1 pressed, volume down
+			volume_set(volume - 1);
+		}
+		else if (pb_rise & (1<<PINF5))
+		{
+			//S2 pressed, volume up
+			volume_set(volume + 1);
+		}
+		break;
+		default:
+		// Invalid state, return to valid idle state (stopped)
+		printf_P(PSTR("ERROR: State machine in main entered invalid state!\n"));
+		state = DVR_STOPPED;
+		PORTD &= 0b10001111; // all LEDs off state
+		PORTD |= (1<<PIND6);   // Turn LED 3 ON
+		break;
+	}
+}
+
+// Ends playback (or a finished recording) and returns to the stopped state
+void dvr_stop() {
+	if (state == DVR_RECORDING) {
+		char* clip_info;
+		
+		write_page(buffer_readPage());		// Write final page
+		adc_stop();							// Buffer is free from here (work area)
+		if (sched_pending() & (1<<SCHED_EVT_METER)) task_meter();	// Measurements of final page
+		
+		// Store clip summary with recording (times in ms, 32.768 ms per page), held
+		// in the work area until the WAVE file is finalised
+		clip_info = (char*)work_page();
+		snprintf_P(clip_info, 64, PSTR("Clips: %lu (first %lu ms, last %lu ms)"),
+			clip_total, ((uint32_t)clip_first * 32768) / 1000, ((uint32_t)clip_last * 32768) / 1000);
+		printf_P(PSTR("%s\n"), clip_info);
+		
+		if (store_mode) {
+			store_close(work_page());		// Write take index to log
+		} else {
+			wave_comment(clip_info);
+			wave_close();					// Finalise WAVE file
+		}
+		if (codec_enabled && (adc_nch == 1)) codec_report();
+		printf_P(PSTR("DONE!\n"));					// Print status to console
+		printf_P(PSTR("Worst-case button latency: %lu us\n"), (uint32_t)latency_max * TIMER_TICK_US);
+		printf_P(PSTR("Record start latency (press to sampling): %lu us\n"), (uint32_t)start_latency * TIMER_TICK_US);
+		if (write_ticks) {
+			wave_layout();	// Format the throughput was measured on
+			printf_P(PSTR("Page writes: %u, avg %lu us, max %lu us (%lu KB/s, CRC %u)\n"), write_pages,
+				(write_ticks * TIMER_TICK_US) / write_pages, (uint32_t)write_max * TIMER_TICK_US,
+				((uint32_t)write_pages * 7812) / write_ticks, crc_mode);	// 512 B / 64 us = 7812 KB/s per tick
+		}
+		{
+			uint32_t busy[3];	// Card write busy statistics (waits, polls, longest wait in polls)
+			if (!disk_ioctl(0, MMC_GET_BUSY, busy) && busy[0]) {
+				printf_P(PSTR("Card write busy: %lu waits, avg %lu polls, max %lu polls (~1.5 us per poll, pre-erase %u)\n"),
+					busy[0], busy[1] / busy[0], busy[2], waveErase);
+			}
+		}
+		if (crc_mode) {
+			uint32_t crc_errors = 0;
+			disk_ioctl(0, MMC_GET_CRCERR, &crc_errors);
+			printf_P(PSTR("CRC errors: %lu\n"), crc_errors);
+		}
+		printf_P(PSTR("Main loop active: %u%%\n"), sched_load());
+		if (noise_pages) {
+			// AC RMS of the take in 1/100 LSB of 8-bit samples (record with the input grounded
+			// for the noise floor, in both idle modes to compare sleep with the busy loop)
+			uint16_t rms = isqrt32((noise_power * 10000) / ((uint32_t)noise_pages * METER_PAGE_SIZE));
+			printf_P(PSTR("Input AC RMS: %u.%02u LSB (idle sleep %u)\n"), rms / 100, rms % 100, schedSleep);
+		}
+		printf_P(PSTR("Stack headroom: %u bytes\n"), stack_free());
+	} else if (state == DVR_PLAYING) {
+		PWM_stop();
+		wave_close();   // Close WAVE file
+		printf_P(PSTR("DONE!\n"));	 // Print status to console
+		PORTD &= 0b10001111; // all LEDs off state
+		PORTD |= (1<<PIND6);  //LED3 on
+		overflow_reset = 2;
+	}
 	
-	uint8_t state = DVR_STOPPED;
-	uint8_t pb = 0x00;
-	uint8_t pb_prev = 0x00;
-	uint8_t pb_rise = 0x00;
+	sched_cancel(SCHED_EVT_PAGE);	// Discard any page transfer still pending
+	sched_cancel(SCHED_EVT_METER);
+	sched_cancel(SCHED_EVT_PREFETCH);
+	state = DVR_STOPPED;			// Transition to stopped state
+}
+
+// SCHED_EVT_PAGE: Transfers one page between the circular buffer and the SD card
+void task_page() {
+	if (state == DVR_RECORDING) {
+		// Write samples to SD card when buffer page is full
+		write_page(buffer_readPage());
+	} else if (state == DVR_PLAYING) {
+		// Read samples from SD card when buffer page is empty
+		uint16_t count = read_page(buffer_writePage());
+		
+		// Where audio data ends, stop once the page playing (and this page) are empty
+		if ((count < 512) && !pageCount) {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				pageCount = count ? 2 : 1;
+			}
+		}
+		
+		// Open next file of playlist ahead of the end of the current file
+		if (wave_needPrefetch()) sched_post(SCHED_EVT_PREFETCH);
+	}
+}
+
+// SCHED_EVT_PREFETCH: Opens next file of playlist in standby
+void task_prefetch() {
+	if (state == DVR_PLAYING) wave_prefetch();
+}
+
+// SCHED_EVT_STOP: Last page has been recorded/played
+void task_stop() {
+	dvr_stop();
+}
+
+// SCHED_EVT_METER: Level measurements of a recorded page are available
+void task_meter() {
+	METER_PAGE page;
 	
-	// Initialisation
-	init();
+	if (state != DVR_RECORDING) return;
 	
-	PORTD |= (1<<PIND6);
-	printf("Your SD card is not plugged in properly. Try again!\n");
+	meter_read(&page);
 	
-	// Loop forever (state machine)
-	// Loop forever (state machine)
-	for(;;) {
-		
-		//Debouncing code
-		pb = pb_debounced;
-		pb_rise = (pb & (pb ^ pb_prev)); //Rising edge
-		pb_prev = pb;
-		
-		
-		// Switch depending on state
-		switch (state) {
-			case DVR_STOPPED:
-			// TODO: Implement button/LED handling for record/playback/stop
-			//S1 pressed
-			if (pb_rise & (1<<PINF4))
-			{
-				printf("Begin Playback...");	// Output status to console
-				playback();
-				state = DVR_PLAYING;
-				PORTD &= 0b10001111; // all LEDs off state
-				PORTD |= (1<<PIND4); // LED1 on
-			} 
-			 if (pb_rise & (1<<PINF5))
-			{
-				// TODO: Implement code to initiate recording
-				//S2 pressed
-		// Output status to console
-				dvr_record();			// Initiate recording
-				state = DVR_RECORDING;
-				PORTD &= 0b10001111; // all LEDs off state
-				PORTD |= (1<<PIND5);  // LED2 on
-				printf("Recording...");
+	// Noise floor of take: power of the page about its mean (DC offset removed)
+	noise_power += page.sumsq - (uint32_t)(((int64_t)page.sum * page.sum) / METER_PAGE_SIZE);
+	noise_pages++;
+	
+	// Clip summary, and overload indication on LED4 (held ~0.5-1 s)
+	if (page.clips) {
+		if (!clip_total) clip_first = page.index;
+		clip_last = page.index;
+		clip_total += page.clips;
+		timer_ledHold = 2;
+	}
+	
+	// LED1: signal present, LED3: level hot
+	if (page.rms > METER_RMS_SIGNAL) PORTD |= (1<<PIND4); else PORTD &= ~(1<<PIND4);
+	if (page.peak > METER_PEAK_HOT) PORTD |= (1<<PIND6); else PORTD &= ~(1<<PIND6);
+	
+	// Live level output (~1 per second)
+	if (meter_live && !(++meter_pages & 0x1F)) {
+		printf_P(PSTR("Level: peak %u rms %u\n"), page.peak, page.rms);
+	}
+}
+
+// SCHED_EVT_BUTTON: Debounced pushbutton state changed
+void task_button() {
+	uint8_t pb = pb_debounced;
+	uint8_t pb_rise = (pb & (pb ^ pb_prev)); //Rising edge
+	uint16_t latency;
+	
+	pb_prev = pb;
+	
+	// Time from debounced edge (in timer ISR) to handling here
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		latency = timer_ticks - pb_timestamp;
+	}
+	if (latency > latency_max) latency_max = latency;
+	
+	button_latency = latency;
+	button_event = 1;
+	dvr_action(pb_rise);
+	button_event = 0;
+	button_latency = 0;
+}
+
+// Idle: Frees clusters of a cut take file in batches (not while recording),
+// then services the USB console
+void task_idle() {
+	uint8_t card = waveCard;
+	
+	// Initialise SD card in background (UI active meanwhile)
+	if (card == WAVE_CARD_BUSY) {
+		card = wave_poll();
+		if (card == WAVE_CARD_READY) {
+			PORTD &= ~(1<<PIND6);	// LED3 off
+			printf_P(PSTR("SD card ready: %lu ms after boot\n"), (uint32_t)timer_uptime() * 10);
+		} else if (card == WAVE_CARD_FAILED) {
+			printf_P(PSTR("Your SD card is not plugged in properly. Try again!\n"));
+		}
+	}
+	
+	if (state != DVR_RECORDING) wave_reclaim();
+	if (state == DVR_RECORDING) wave_segmentIdle();	// Finalise previous/pre-open next segment
+	if (state == DVR_STOPPED) {
+		wave_erase();				// Pre-erase take file for next take (waits for verify)
+		if (!wave_verify(work_page())) store_export(work_page());	// Verify last take, then export from raw log store
+	}
+	task_console();
+}
+
+// Services USB console commands (mirror the pushbuttons)
+void task_console() {
+	int16_t c;
+	
+	if (!serial_available()) return;
+	
+	c = usb_serial_getchar();
+	
+	// Format and clearing the log require confirmation (any other key cancels)
+	if (confirm_cmd) {
+		if ((c == 'Y') && (state == DVR_STOPPED) && (waveCard == WAVE_CARD_READY)) {
+			if (confirm_cmd == 'F') {
+				store_exportStop();	// Export file is lost by format
+				store_mode = 0;		// Log region is erased by format
+				if (wave_mkfs() && store_reserve()) {	// Log region reserved while the card is empty (contiguous)
+					printf_P(PSTR("Format complete\n"));
+					wave_layout();
+				} else {
+					printf_P(PSTR("Format failed\n"));
+				}
+			} else {
+				store_clear(work_page());
+				printf_P(PSTR("Log cleared\n"));
 			}
+		} else {
+			printf_P(PSTR("Cancelled\n"));
+		}
+		confirm_cmd = 0;
+		return;
+	}
+	
+	switch (c) {
+		case 'p': dvr_action(1<<PINF4); break;	// Play (S1)
+		case 'r': dvr_action(1<<PINF5); break;	// Record (S2)
+		case 's': dvr_action(1<<PINF6); break;	// Stop (S3)
+		case 'l':	// Load and stack headroom
+			printf_P(PSTR("Main loop active: %u%%\n"), sched_load());
+			printf_P(PSTR("Stack headroom: %u bytes\n"), stack_free());
+			break;
+		case 'o':	// Cycle ADC oversampling ratio (1, 4, 8)
+			if (state == DVR_RECORDING) break;
+			printf_P(PSTR("ADC oversampling: %ux\n"), adc_oversample(adc_osr == 1 ? 4 : adc_osr << 1));
+			break;
+		case 'd':	// Toggle DC blocker
+		case 'e':	// Toggle pre-emphasis
+		case 'a':	// Toggle automatic gain control
+			if (state == DVR_RECORDING) break;
+			dsp_config(dsp_flags ^ (c == 'd' ? DSP_DCBLOCK : (c == 'e' ? DSP_PREEMPH : DSP_AGC)));
+			printf_P(PSTR("DSP: DC blocker %u, pre-emphasis %u, AGC %u\n"),
+				(dsp_flags & DSP_DCBLOCK) != 0, (dsp_flags & DSP_PREEMPH) != 0, (dsp_flags & DSP_AGC) != 0);
+			break;
+		case 'c':	// Toggle lossless codec for recording
+			if (state == DVR_RECORDING) break;
+			codec_enabled = !codec_enabled;
+			printf_P(PSTR("Lossless codec: %u\n"), codec_enabled);
+			break;
+		case 'T':	// Toggle stereo recording (ADC0/ADC1 alternate, 7.8 kHz per channel)
+			if (state != DVR_STOPPED) break;
+			stereo = !stereo;
+			printf_P(PSTR("Stereo: %u\n"), stereo);
+			break;
+		case 'P':	// Toggle dual PWM (16-bit) output (takes effect at next playback)
+			if (state == DVR_PLAYING) break;
+			pwm_dual = !pwm_dual;
+			printf_P(PSTR("Dual PWM output: %u\n"), pwm_dual);
+			break;
+		case 'N':	// Select noise shaping of 8-bit output (off, first, second order)
+			if (state == DVR_PLAYING) break;
+			ns_order = (ns_order + 1) % 3;
+			printf_P(PSTR("Noise shaping: %u\n"), ns_order);
 			break;
-			case DVR_RECORDING:
-			if (pb_rise & (1<<PINF6))
+		case 'b':	// Measure record DSP cost per stage (cycles per sample, of 1024 per ADC trigger)
+			if (state != DVR_STOPPED) break;
 			{
-				// TODO: Implement stop functionality
-				//S3 pressed
-				PORTD &= 0b10001111; // all LEDs off state
-				PORTD |= (1<<PIND6);  //LED3 on
-				
-				pageCount = 1;	// Finish recording last page
+				uint16_t base = dsp_cycles(0);
+				printf_P(PSTR("DSP cycles per sample: output %u, DC blocker +%u, pre-emphasis +%u, AGC +%u, all %u of 1024\n"),
+					base, dsp_cycles(DSP_DCBLOCK) - base, dsp_cycles(DSP_PREEMPH) - base, dsp_cycles(DSP_AGC) - base,
+					dsp_cycles(DSP_DCBLOCK | DSP_PREEMPH | DSP_AGC));
 			}
-			// Write samples to SD card when buffer page is full
-			if (newPage) {
-				countpage++;
-				newPage = 0;	// Acknowledge new page flag
-				wave_write(buffer_readPage(), 512);
-				} 
-			else if (stop) {
-				// Stop is flagged when the last page has been recorded
-				stop = 0;							// Acknowledge stop flag
-				wave_write(buffer_readPage(), 512);	// Write final page
-				wave_close();						// Finalise WAVE file
-				adc_stop();
-				printf("DONE!\n");					// Print status to console
-				while (pb_rise & (1<<PINF6)){
-					printf("Please release record button ........ \n");
-				continue;}
-				state = DVR_STOPPED;				// Transition to stopped state
+			break;
+		case 'i':	// Toggle sleep when idle (busy loop for noise floor comparison)
+			if (state == DVR_RECORDING) break;
+			sched_sleep(!schedSleep);
+			printf_P(PSTR("Idle sleep: %u\n"), schedSleep);
+			break;
+		case 'q':	// Toggle quick record start (reuse preallocated take file)
+			if (state == DVR_RECORDING) break;
+			wave_reuse(!waveReuse);
+			printf_P(PSTR("Reuse take file: %u\n"), waveReuse);
+			break;
+		case 'X':	// Toggle pre-erase of take file while idle (compare card write busy)
+			if (state == DVR_RECORDING) break;
+			wave_preErase(!waveErase);
+			printf_P(PSTR("Pre-erase take file: %u\n"), waveErase);
+			break;
+		case 'v':	// Verify last take against its checksums (reports damaged time ranges)
+			if ((state != DVR_STOPPED) || (waveCard != WAVE_CARD_READY)) break;
+			store_exportSuspend();	// Export file structure is used by verify
+			if (!wave_verifyStart()) printf_P(PSTR("No checksums!\n"));
+			break;
+		case 'K':	// Toggle CRC of SD card transfers (reports sector read time)
+			if ((state != DVR_STOPPED) || (waveCard != WAVE_CARD_READY)) break;
+			crc_set(!crc_mode);
+			break;
+		case 'S':	// Toggle segmented recording (60 s files, play all with playlist)
+			if (state != DVR_STOPPED) break;
+			wave_segment(!waveSegment);
+			printf_P(PSTR("Segments: %u\n"), waveSegment);
+			break;
+		case 'L':	// Toggle playlist (gapless playback of all WAVE files)
+			if (state != DVR_STOPPED) break;
+			playlist = !playlist;
+			printf_P(PSTR("Playlist: %u\n"), playlist);
+			break;
+		case 'R':	// Toggle repeat mode (takes effect during playback)
+			wave_repeat(!waveRepeat);
+			printf_P(PSTR("Repeat: %u\n"), waveRepeat);
+			break;
+		case '+':	// Playback volume up
+		case '-':	// Playback volume down
+			volume_set(volume + (c == '+' ? 1 : -1));
+			break;
+		case 'k':	// Drop marker during recording
+			record_mark(0);
+			break;
+		case '1': case '2': case '3': case '4': case '5':
+		case '6': case '7': case '8': case '9':	// Continue playback from marker
+			play_cue(c - '0');
+			break;
+		case '<':	// Seek back during playback
+		case '>':	// Seek forward during playback
+			play_seek(c == '>' ? 1 : -1);
+			break;
+		case 'E':	// Discard last take, pre-erase take file for next take
+			if ((state != DVR_STOPPED) || (waveCard != WAVE_CARD_READY)) break;
+			store_exportSuspend();	// Export file structure is used by take file preparation (sidecar)
+			wave_prepare();
+			printf_P(PSTR("Take file pre-erase started\n"));
+			break;
+		case 'F':	// Quick format SD card for recording (confirm with 'Y')
+			if ((state != DVR_STOPPED) || (waveCard != WAVE_CARD_READY)) break;
+			confirm_cmd = 'F';
+			printf_P(PSTR("Format SD card? All files are erased (Y to confirm)\n"));
+			break;
+		case 'g':	// Toggle recording to raw log store
+			if ((state != DVR_STOPPED) || (waveCard != WAVE_CARD_READY)) break;
+			if (!store_mode) {
+				uint8_t result = store_mount(work_page());
+				if (result == STORE_FRAGMENTED) printf_P(PSTR("Log region fragmented, format card (F)\n"));
+				if (result == STORE_UNRESERVED) printf_P(PSTR("No log region, format card (F)\n"));
+				store_mode = (result == STORE_OK);
+			} else {
+				store_mode = 0;
 			}
-			
-			
-			
+			printf_P(PSTR("Record to log: %u\n"), store_mode);
 			break;
-			case DVR_PLAYING:
-			if (newPage)
-			{
-				newPage = 0;	// Acknowledge new page flag
-				wave_read(buffer_writePage(), 512);
-
-			}	 else if (stop || (pb_rise & (1<<PINF6))){
-				// TODO: Implement playback functionality
-					stop = 0;       // Acknowledge stop flag
-					wave_close();   // Finalise WAVE file
-					PWM_stop();
-					printf("DONE!\n");	 // Print status to console
-					//S3 pressed
-					PORTD &= 0b10001111; // all LEDs off state
-					PORTD |= (1<<PIND6);  //LED3 on
-					state = DVR_STOPPED;
-					overflow_reset = 2;
-				}
-				
-			// TODO: Implement playback functionality
+		case 'x':	// Export last take in raw log store to WAVE file
+			if ((state != DVR_STOPPED) || !store_mode) break;
+			if (!store_exportStart(0, work_page())) printf_P(PSTR("Nothing to export\n"));
 			break;
-			default:
-			
-			// Invalid state, return to valid idle state (stopped)
-			printf("ERROR: State machine in main entered invalid state!\n");
-			state = DVR_STOPPED;
-			PORTD |= (1<<PIND6);   // Turn LED 3 ON
-			PORTD &= 0b10001111; // all LEDs off state
+		case 'z':	// Clear raw log store (confirm with 'Y')
+			if ((state != DVR_STOPPED) || !store_mode) break;
+			confirm_cmd = 'z';
+			printf_P(PSTR("Clear log? All takes are discarded (Y to confirm)\n"));
 			break;
-		
-
-	} // END for(;;)
+		case 'm':	// Toggle live level output
+			meter_live = !meter_live;
+			break;
+		case 'w':	// Print waveform overview of last take
+			if ((state == DVR_STOPPED) && (waveCard == WAVE_CARD_READY)) meter_dump();
+			break;
+		default: break;
 	}
-
-
-
 }
 
+/************************************************************************/
+/* MAIN LOOP (CODE ENTRY)                                               */
+/************************************************************************/
+int main(void) {
+	
+	// Initialisation
+	stack_paint();	// Stack headroom reported by 'l' and after each take
+	init();
+	
+	PORTD |= (1<<PIND6);	// LED3 on until SD card is ready
+	
+	// Assign handlers for events posted by buffer callbacks and timer ISR
+	sched_register(SCHED_EVT_PAGE, task_page);
+	sched_register(SCHED_EVT_STOP, task_stop);
+	sched_register(SCHED_EVT_BUTTON, task_button);
+	sched_register(SCHED_EVT_METER, task_meter);
+	sched_register(SCHED_EVT_PREFETCH, task_prefetch);
+	sched_idle(task_idle);
+	
+	// Loop forever (run event handlers)
+	for(;;) {
+		sched_dispatch();
+	}
+}
@@ -0,0 +1,216 @@
+/**
+ * meter.c - EGB240DVR Library, Level meter module
+ *
+ * Measures the peak and RMS level of recorded audio as samples enter
+ * the buffer (no additional pass over the data). meter_sample is called
+ * from the ADC ISR for every sample queued (~35 cycles: one 8 x 8 MULS
+ * for the square, a 32-bit sum for the DC offset, and compares for peak
+ * and min/max). Once per page the accumulated values are latched
+ * (meter_page) and a scheduler event is posted so the application can
+ * display them. The latched sums also give the noise floor of a whole
+ * take (AC RMS, recorded with the input grounded).
+ *
+ * For each METER_OVERVIEW_N samples a min/max pair is recorded. The pairs
+ * of a page are stored with the checksum of the page in the sidecar file
+ * of the take (see wave_page), allowing host tools (or the device) to
+ * render or scan a take without reading the audio data. The pairs are
+ * held for two pages (by page parity), so those of a page remain valid
+ * until it is written while the next page fills.
+ *
+ * The ADC ISR also counts conversions at the ADC rails (meter_clips),
+ * which are summarised per page along with the level measurements.
+ *
+ * Requires:
+ *   lib/fatfs - FatFs FAT file system library published by ChaN
+ *   sched - Scheduler, used to signal page measurements are available
+ *   wave - WAVE file interface, layout of sidecar file (meter_dump)
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+/************************************************************************/
+/* INCLUDED LIBRARIES/HEADER FILES                                      */
+/************************************************************************/
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include <string.h>
+#include <stdio.h>
+
+#include "lib/fatfs/ff.h"
+
+#include "sched.h"
+#include "wave.h"
+#include "meter.h"
+
+/************************************************************************/
+/* GLOBAL VARIABLES                                                     */
+/************************************************************************/
+uint8_t meter_peak;		// Peak magnitude in current page
+uint32_t meter_sumsq;	// Sum of squares in current page
+int32_t meter_sum;		// Sum of deviations in current page (DC offset)
+uint8_t meter_min;		// Minimum sample in current overview interval
+uint8_t meter_max;		// Maximum sample in current overview interval
+uint16_t meter_count;	// Samples remaining in current overview interval
+uint8_t meter_pairs[2][2*METER_PAIRS];	// Overview pairs of current and previous page (by parity)
+uint8_t meter_pairIndex;	// Index of next overview byte in current page
+uint16_t meter_clips;	// Clipped conversions in current page
+uint16_t meter_index;	// Number of current page within take
+
+METER_PAGE meter_latched;	// Measurements of last complete page
+
+/************************************************************************/
+/* PRIVATE/UTILLITY FUNCTIONS                                           */
+/************************************************************************/
+
+// Integer square root (of a value up to 16384)
+static uint8_t isqrt(uint16_t x) {
+	uint8_t r = 0;
+	
+	for (uint8_t bit = 0x80; bit; bit >>= 1) {
+		uint8_t t = r | bit;
+		if ((uint16_t)t * t <= x) r = t;
+	}
+	
+	return r;
+}
+
+/************************************************************************/
+/* PUBLIC/USER FUNCTIONS                                                */
+/************************************************************************/
+
+/**
+ * Function: meter_reset
+ * 
+ * Resets the page accumulators. Must be called before sampling starts,
+ * so that overview intervals are aligned with buffer pages.
+ */
+void meter_reset() {
+	meter_peak = 0;
+	meter_sumsq = 0;
+	meter_sum = 0;
+	meter_min = 0xFF;
+	meter_max = 0x00;
+	meter_count = METER_OVERVIEW_N;
+	meter_pairIndex = 0;
+	meter_clips = 0;
+	meter_index = 0;
+}
+
+/**
+ * Function: meter_sample
+ * 
+ * Accumulates a recorded sample into the page measurements.
+ * Called from the ADC ISR for every sample queued into the buffer.
+ *
+ * Parameters:
+ *    sample - Unsigned 8-bit sample (0x80 = midscale)
+ */
+void meter_sample(uint8_t sample) {
+	int8_t d = sample ^ 0x80;	// Signed deviation from midscale
+	uint8_t mag = (d < 0) ? -d : d;
+	
+	if (mag > meter_peak) meter_peak = mag;
+	meter_sumsq += (int16_t)d * d;	// 8 x 8 signed multiply
+	meter_sum += d;
+	
+	if (sample < meter_min) meter_min = sample;
+	if (sample > meter_max) meter_max = sample;
+	
+	if (!(--meter_count)) {
+		meter_count = METER_OVERVIEW_N;
+		if (meter_pairIndex < sizeof(meter_pairs[0])) {
+			uint8_t* pPairs = meter_pairs[meter_index & 1];
+			pPairs[meter_pairIndex++] = meter_min;
+			pPairs[meter_pairIndex++] = meter_max;
+		}
+		meter_min = 0xFF;
+		meter_max = 0x00;
+	}
+}
+
+/**
+ * Function: meter_page
+ * 
+ * Latches the measurements of the page just completed and signals the
+ * application (SCHED_EVT_METER). Must be called once per buffer page
+ * (from the "page full" callback), after the last sample of the page.
+ */
+void meter_page() {
+	meter_latched.index = meter_index++;
+	meter_latched.clips = meter_clips;
+	meter_latched.peak = meter_peak;
+	meter_latched.rms = isqrt(meter_sumsq / METER_PAGE_SIZE);
+	meter_latched.sumsq = meter_sumsq;
+	meter_latched.sum = meter_sum;
+	
+	meter_peak = 0;
+	meter_sumsq = 0;
+	meter_sum = 0;
+	meter_pairIndex = 0;
+	meter_clips = 0;
+	
+	sched_post(SCHED_EVT_METER);
+}
+
+/**
+ * Function: meter_read
+ * 
+ * Copies the measurements of the last complete page.
+ *
+ * Parameters:
+ *    pPage - Pointer to structure to receive measurements.
+ */
+void meter_read(METER_PAGE* pPage) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*pPage = meter_latched;
+	}
+}
+
+/**
+ * Function: meter_pagePairs
+ * 
+ * Returns the overview pairs of a page. Valid from the end of the page
+ * until the end of the page following it.
+ *
+ * Parameters:
+ *    index - Page number within take.
+ */
+const uint8_t* meter_pagePairs(uint16_t index) {
+	return meter_pairs[index & 1];
+}
+
+/**
+ * Function: meter_dump
+ * 
+ * Prints the overview of the last take (from its sidecar file) to the
+ * console, one min/max pair per line.
+ */
+void meter_dump() {
+	FRESULT result;
+	FIL sumFile;
+	WAVE_SUM_HEADER header;
+	WAVE_SUM_RECORD record;
+	uint16_t index = 0;
+	UINT br;
+	
+	result = f_open(&sumFile, WAVE_SUM_FILENAME, FA_READ);
+	if (result) {
+		printf_P(PSTR("f_open returned error code: %d\n"), result);
+		return;
+	}
+	
+	result = f_read(&sumFile, &header, sizeof(header), &br);
+	if (!result && (br == sizeof(header)) && !memcmp_P(header.ID, PSTR("SUM2"), 4)) {
+		printf_P(PSTR("Overview: %u samples per pair\n"), header.N);
+		while (!f_read(&sumFile, &record, sizeof(record), &br) && (br == sizeof(record))) {
+			for (uint8_t i = 0; i < sizeof(record.pairs); i += 2) {
+				printf_P(PSTR("%u %u %u\n"), index++, record.pairs[i], record.pairs[i + 1]);
+			}
+		}
+	}
+	
+	f_close(&sumFile);
+}
@@ -0,0 +1,41 @@
+/**
+ * meter.h - EGB240DVR Library, Level meter module header
+ *
+ * Incremental peak/RMS metering of recorded samples and waveform
+ * overview (min/max, stored in the checksum sidecar file).
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+#ifndef METER_H_
+#define METER_H_
+
+#define METER_PAGE_SIZE		512		// Samples per buffer page
+#define METER_OVERVIEW_N	256		// Samples per overview min/max pair
+#define METER_PAIRS			(METER_PAGE_SIZE / METER_OVERVIEW_N)	// Overview pairs per page
+
+// Level thresholds (magnitude relative to 0x80 midpoint, full scale = 128)
+#define METER_RMS_SIGNAL	4		// RMS above which signal is present (-30 dBFS)
+#define METER_PEAK_HOT		64		// Peak above which level is hot (-6 dBFS)
+
+// Measurements latched for a single page
+typedef struct {
+	uint16_t	index;		// Page number within take (0 = first page)
+	uint16_t	clips;		// Number of conversions at an ADC rail
+	uint8_t		peak;		// Peak magnitude (0-128)
+	uint8_t		rms;		// RMS magnitude (0-128)
+	uint32_t	sumsq;		// Sum of squared deviations from midscale (take noise floor)
+	int32_t		sum;		// Sum of deviations from midscale (DC offset)
+} METER_PAGE;
+
+extern uint16_t meter_clips;	// Clipped conversions in current page (incremented by ADC ISR)
+
+void meter_reset();			// Resets accumulators (call before sampling starts)
+void meter_sample(uint8_t sample);	// Accumulates a sample (call from ADC ISR)
+void meter_page();			// Latches page measurements (call once per page, ISR)
+void meter_read(METER_PAGE* pPage);	// Copies the last latched page measurements
+const uint8_t* meter_pagePairs(uint16_t index);	// Overview pairs of a page (valid until the next page ends)
+void meter_dump();			// Prints overview of last take (sidecar file) to console
+
+#endif /* METER_H_ */
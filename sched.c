@@ -0,0 +1,235 @@
+/**
+ * sched.c - EGB240DVR Library, Cooperative scheduler module
+ *
+ * Implements a small run-queue of event handlers. Interrupt service
+ * routines (and application code) post events by setting a bit in a
+ * pending mask; the main loop repeatedly calls sched_dispatch, which
+ * runs the handler of the highest priority pending event.
+ *
+ * Handlers run to completion and must return promptly (e.g. transfer a
+ * single page to/from the SD card, or service one console command), so
+ * that every other handler makes progress between slices. When no event
+ * is pending the idle handler is run instead (e.g. USB console polling).
+ *
+ * Only one handler runs per call to sched_dispatch. Each event is
+ * re-examined in priority order on every call, so a page transfer is
+ * never delayed by more than one lower priority slice.
+ *
+ * Where no events remain after the idle handler has run, the CPU is put
+ * into IDLE sleep until the next interrupt (SCHED_IDLE_SLEEP). Timer0,
+ * the ADC, SPI and USB all keep running in IDLE mode, so a sample or a
+ * page event wakes the CPU. The deeper ADC Noise Reduction mode is not
+ * used: it halts clkIO, which stops Timer0 (the ADC trigger source),
+ * the SPI module and USB, so it cannot sustain 15.625 kHz triggered
+ * conversions while pages are streamed to the SD card. IDLE sleep
+ * still halts the CPU core clock for most of each sample period, which
+ * removes the bulk of the digital switching noise of the busy loop.
+ * Sleep may be disabled at run time (sched_sleep), so that the noise
+ * floor of a take recorded with the input grounded can be compared
+ * against the busy loop on the same build (input RMS of each take).
+ *
+ * The fraction of time the main loop is awake (not sleeping) is sampled
+ * from a timer ISR via sched_tick and reported by sched_load.
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+/************************************************************************/
+/* INCLUDED LIBRARIES/HEADER FILES                                      */
+/************************************************************************/
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+#include "sched.h"
+
+/************************************************************************/
+/* GLOBAL VARIABLES                                                     */
+/************************************************************************/
+volatile uint8_t sched_events = 0x00;	// Mask of pending events (bit n = event n)
+
+volatile uint8_t sched_asleep = 0;		// Flag set while the CPU sleeps in sched_dispatch
+uint8_t schedSleep = SCHED_IDLE_SLEEP;	// Flag to sleep when no events are pending (0 = busy loop)
+volatile uint16_t sched_ticksActive = 0;	// Ticks sampled awake in current window
+volatile uint16_t sched_ticksWindow = 0;	// Ticks sampled in current window
+volatile uint8_t sched_percentActive = 100;	// Active percentage over last complete window
+
+/************************************************************************/
+/* FUNCTION POINTERS                                                    */
+/************************************************************************/
+void (*sched_handlers[SCHED_EVENTS])(void);	// Handler for each event
+void (*sched_handlerIdle)(void);			// Handler run when no event is pending
+
+/************************************************************************/
+/* PUBLIC/USER FUNCTIONS                                                */
+/************************************************************************/
+
+/**
+ * Function: sched_init
+ * 
+ * Initialises the scheduler for first use. Clears all pending events
+ * and unassigns all handlers.
+ */
+void sched_init() {
+	sched_events = 0x00;
+	
+	for (uint8_t i = 0; i < SCHED_EVENTS; i++) {
+		sched_handlers[i] = 0;
+	}
+	sched_handlerIdle = 0;
+}
+
+/**
+ * Function: sched_register
+ * 
+ * Assigns a handler to an event. The handler is executed (once) from
+ * sched_dispatch after the event has been posted.
+ *
+ * Parameters:
+ *    event - Event identifier (SCHED_EVT_*)
+ *    pFunc - Pointer to function to execute on event
+ */
+void sched_register(uint8_t event, void (*pFunc)(void)) {
+	sched_handlers[event] = pFunc;
+}
+
+/**
+ * Function: sched_idle
+ * 
+ * Assigns the handler executed from sched_dispatch when no events
+ * are pending.
+ *
+ * Parameters:
+ *    pFunc - Pointer to function to execute when idle
+ */
+void sched_idle(void (*pFunc)(void)) {
+	sched_handlerIdle = pFunc;
+}
+
+/**
+ * Function: sched_post
+ * 
+ * Posts an event. Posting an event which is already pending has no
+ * further effect (events are not counted). Safe to call from an ISR.
+ *
+ * Parameters:
+ *    event - Event identifier (SCHED_EVT_*)
+ */
+void sched_post(uint8_t event) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sched_events |= (1<<event);
+	}
+}
+
+/**
+ * Function: sched_cancel
+ * 
+ * Discards an event if it is pending.
+ *
+ * Parameters:
+ *    event - Event identifier (SCHED_EVT_*)
+ */
+void sched_cancel(uint8_t event) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sched_events &= ~(1<<event);
+	}
+}
+
+/**
+ * Function: sched_pending
+ * 
+ * Returns: Mask of pending events (bit n set where event n is pending)
+ */
+uint8_t sched_pending() {
+	return sched_events;
+}
+
+/**
+ * Function: sched_dispatch
+ * 
+ * Runs the handler of the highest priority (lowest numbered) pending
+ * event, acknowledging the event before the handler is called so that
+ * it may be re-posted while the handler runs. Runs the idle handler
+ * where no events are pending, then sleeps until the next interrupt
+ * if no event has been posted in the meantime.
+ */
+void sched_dispatch() {
+	uint8_t event = 0;
+	uint8_t mask = 0x01;
+	
+	// Find and acknowledge highest priority event
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		while (mask && !(sched_events & mask)) {
+			mask <<= 1;
+			event++;
+		}
+		sched_events &= ~mask;
+	}
+	
+	if (mask) {
+		if (sched_handlers[event]) sched_handlers[event]();
+	} else {
+		if (sched_handlerIdle) sched_handlerIdle();
+		
+#if SCHED_IDLE_SLEEP
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		cli();
+		if (schedSleep && !sched_events) {
+			// Interrupts are enabled by SEI only after the following
+			// instruction (SLEEP), so a wake-up event cannot be missed
+			sched_asleep = 1;
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+			sched_asleep = 0;
+		}
+		sei();
+#endif
+	}
+}
+
+/**
+ * Function: sched_sleep
+ * 
+ * Enables or disables IDLE sleep when no events are pending (busy loop
+ * where disabled, for comparison). Has no effect where sleep is not
+ * built in (SCHED_IDLE_SLEEP = 0).
+ *
+ * Parameters:
+ *    enable - Non-zero to sleep when idle.
+ */
+void sched_sleep(uint8_t enable) {
+	schedSleep = enable && SCHED_IDLE_SLEEP;
+}
+
+/**
+ * Function: sched_tick
+ * 
+ * Samples whether the main loop is awake. Must be called from a
+ * regular timer ISR (Timer0, every 64 us). Executes in a few cycles,
+ * latching the active percentage once per SCHED_LOAD_WINDOW ticks.
+ * Note that ISR execution time while the main loop sleeps is counted
+ * as inactive.
+ */
+void sched_tick() {
+	if (!sched_asleep) sched_ticksActive++;
+	
+	if (++sched_ticksWindow == SCHED_LOAD_WINDOW) {
+		sched_percentActive = sched_ticksActive >> SCHED_LOAD_SHIFT;
+		sched_ticksActive = 0;
+		sched_ticksWindow = 0;
+	}
+}
+
+/**
+ * Function: sched_load
+ * 
+ * Returns: Percentage of time (0-100) the main loop was awake over the
+ *          last complete sampling window (100 when sleep is disabled).
+ */
+uint8_t sched_load() {
+	return sched_percentActive;
+}
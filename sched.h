@@ -0,0 +1,46 @@
+/**
+ * sched.h - EGB240DVR Library, Cooperative scheduler module header
+ *
+ * Run-queue of event handlers fed by events posted from interrupt
+ * service routines (or application code).
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */ 
+
+#ifndef SCHED_H_
+#define SCHED_H_
+
+// Event identifiers (bit index into the pending event mask)
+// Lower numbers are dispatched first (higher priority)
+#define SCHED_EVT_PAGE		0	// Buffer page full/empty, SD transfer due
+#define SCHED_EVT_STOP		1	// Final page of a take recorded/played
+#define SCHED_EVT_BUTTON	2	// Debounced pushbutton state changed
+#define SCHED_EVT_METER		3	// Page level measurements available
+#define SCHED_EVT_PREFETCH	4	// Next file of playlist should be opened
+#define SCHED_EVENTS		8	// Maximum number of events (bits in mask)
+
+// Sleep (IDLE mode) when no events are pending. Set to 0 to busy-wait instead.
+#ifndef SCHED_IDLE_SLEEP
+#define SCHED_IDLE_SLEEP	1
+#endif
+
+// Active time is sampled on each call to sched_tick over a window of
+// SCHED_LOAD_WINDOW ticks (12800 ticks = 819 ms at 64 us per tick)
+#define SCHED_LOAD_SHIFT	7
+#define SCHED_LOAD_WINDOW	(100U << SCHED_LOAD_SHIFT)
+
+extern uint8_t schedSleep;	// Sleep when idle enabled (see sched_sleep)
+
+void sched_init();		// Clears pending events and registered handlers
+void sched_register(uint8_t event, void (*pFunc)(void));	// Assigns a handler to an event
+void sched_idle(void (*pFunc)(void));	// Assigns the handler run when no events are pending
+void sched_post(uint8_t event);		// Posts an event (safe to call from an ISR)
+void sched_cancel(uint8_t event);	// Discards a pending event
+uint8_t sched_pending();	// Returns the mask of pending events
+void sched_dispatch();		// Runs the highest priority pending handler (or the idle handler)
+void sched_sleep(uint8_t enable);	// Enables/disables sleep when idle (busy loop for comparison)
+void sched_tick();			// Samples CPU activity (call from a regular timer ISR)
+uint8_t sched_load();		// Returns the percentage of time the main loop was active
+
+#endif /* SCHED_H_ */
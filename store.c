@@ -0,0 +1,500 @@
+/**
+ * store.c - EGB240DVR Library, Raw log store module
+ *
+ * Alternative storage engine for recordings. Takes are written as an
+ * append-only log of 512 byte pages (one sector per page, disk_write)
+ * into a reserved contiguous region of the SD card, with no filesystem
+ * work (FAT, directory or cluster chain updates) while recording.
+ *
+ * The region is reserved by a file (STORE_FILENAME) of STORE_SECTORS
+ * sectors, created through FatFs so the region is protected from other
+ * use and visible to a host. The file is created once, when the card is
+ * formatted (store_reserve), so it occupies a single fragment and its
+ * clusters are never allocated from a console command or while the
+ * application runs; its first sector is located when mounted using the
+ * fast seek cluster map. Region layout:
+ *
+ *   Sector 0: log header ("LOG1", generation, takes ever recorded)
+ *   Sector 1: index of take 1 ("TAKE", generation, number, pages, rate)
+ *             followed by the pages of take 1
+ *   then the index of take 2, ...
+ *
+ * The index of a take is written when the take is closed, so a take is
+ * valid only once complete. Takes are found by following the page counts
+ * from the start of the region; the chain ends at the first sector which
+ * is not an index of the current generation (clearing the log increments
+ * the generation, so stale takes beyond the new end are not followed).
+ *
+ * Takes are materialised as standard WAVE files (TAKEnnn.WAV) through
+ * FatFs by the exporter, a few pages per call from idle time. The file
+ * structure of the export is shared with the WAVE file interface
+ * (auxFile), so the export file is closed before any recording, playback
+ * or verify (store_exportSuspend) and reopened by the next call.
+ *
+ * Sector sized work areas are supplied by the caller (a buffer page while
+ * stopped), so the module holds no sector buffer of its own.
+ *
+ * Requires:
+ *   lib/fatfs - FatFs FAT file system library published by ChaN
+ *   wave - WAVE file interface (owns the mounted file system)
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */
+
+/************************************************************************/
+/* INCLUDED LIBRARIES/HEADER FILES                                      */
+/************************************************************************/
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#include <string.h>
+#include <stdio.h>
+
+#include "lib/fatfs/ff.h"
+#include "lib/fatfs/diskio.h"
+
+#include "wave.h"
+#include "store.h"
+
+/************************************************************************/
+/* GLOBAL VARIABLES                                                     */
+/************************************************************************/
+extern FATFS fs;		// File system structure for SD card access (wave.c)
+extern FIL auxFile;		// File structure shared with WAVE file interface (wave.c)
+
+uint32_t store_base = 0;		// First sector (LBA) of log region (0 = not mounted)
+uint16_t store_generation = 0;	// Generation of log
+uint16_t store_number = 0;		// Number of takes ever recorded in this generation
+uint16_t store_takes = 0;		// Number of takes in log
+uint32_t store_next = 0;		// Sector (within region) of next take index
+uint32_t store_sector = 0;		// Sector (within region) of next page of take being recorded
+
+uint8_t exportActive = 0;		// Flag to indicate export in progress
+uint8_t exportOpen = 0;			// Flag to indicate export file is open (auxFile)
+uint16_t exportNumber = 0;		// Number of take being exported (file name)
+uint32_t exportSector = 0;		// Sector (within region) of next page to export
+uint32_t exportRemaining = 0;	// Pages of take remaining to export
+
+/************************************************************************/
+/* PRIVATE/UTILLITY FUNCTIONS                                           */
+/************************************************************************/
+
+/**
+ * Function: read_index
+ *
+ * Reads a sector of the log region and checks it is a take index of the
+ * current generation.
+ *
+ * Parameters:
+ *    sector - Sector within log region.
+ *    pWork - 512 byte work buffer (receives sector).
+ *
+ * Returns: Pointer to index, or 0 where sector is not a valid index.
+ */
+STORE_INDEX* read_index(uint32_t sector, uint8_t* pWork) {
+	STORE_INDEX* pIndex = (STORE_INDEX*)pWork;
+
+	if (disk_read(0, pWork, store_base + sector, 1)) return 0;
+	if (memcmp_P(pIndex->ID, PSTR("TAKE"), 4) || (pIndex->generation != store_generation)) return 0;
+
+	return pIndex;
+}
+
+/**
+ * Function: write_header
+ *
+ * Writes the log header (first sector of region).
+ *
+ * Parameters:
+ *    pWork - 512 byte work buffer.
+ */
+void write_header(uint8_t* pWork) {
+	STORE_INDEX* pHeader = (STORE_INDEX*)pWork;
+
+	memset(pWork, 0, 512);
+	memcpy_P(pHeader->ID, PSTR("LOG1"), 4);
+	pHeader->generation = store_generation;
+	pHeader->number = store_number;
+
+	if (disk_write(0, pWork, store_base, 1)) printf_P(PSTR("disk_write returned error\n"));
+}
+
+/**
+ * Function: export_name
+ *
+ * Forms the file name of the take being exported (TAKEnnn.WAV).
+ *
+ * Parameters:
+ *    name - Buffer to receive name (13 characters).
+ */
+void export_name(char* name) {
+	snprintf_P(name, 13, PSTR("TAKE%03u.WAV"), exportNumber);
+}
+
+/************************************************************************/
+/* PUBLIC/USER FUNCTIONS                                                */
+/************************************************************************/
+
+/**
+ * Function: store_reserve
+ *
+ * Creates the log file at its full size (clusters allocated, not written),
+ * reserving the log region. Called once the card is formatted (see
+ * wave_mkfs), where the free space is a single run, so the region is
+ * contiguous.
+ *
+ * Returns: Non-zero where successful.
+ */
+uint8_t store_reserve() {
+	FRESULT result;
+	FIL logFile;
+
+	store_base = 0;
+
+	result = f_open(&logFile, STORE_FILENAME, FA_CREATE_ALWAYS | FA_WRITE);
+	if (result) {
+		printf_P(PSTR("f_open returned error code: %d\n"), result);
+		return 0;
+	}
+
+	result = f_lseek(&logFile, STORE_SECTORS * 512);
+	if (!result && (f_size(&logFile) < STORE_SECTORS * 512)) result = FR_DENIED;	// Card full
+	if (result) printf_P(PSTR("f_lseek returned error code: %d\n"), result);
+
+	f_close(&logFile);
+
+	return !result;
+}
+
+/**
+ * Function: store_mount
+ *
+ * Locates the log region (reserved by store_reserve when the card was
+ * formatted) on the card and scans the takes it holds. No clusters are
+ * allocated. Must be called (with the card mounted) before any other
+ * function in the module.
+ *
+ * Parameters:
+ *    pWork - 512 byte work buffer.
+ *
+ * Returns: STORE_OK, STORE_UNRESERVED, STORE_FRAGMENTED or STORE_ERROR.
+ */
+uint8_t store_mount(uint8_t* pWork) {
+	FRESULT result;
+	FIL logFile;
+	DWORD clmt[4];	// Cluster map: size, (clusters, start cluster), terminator
+	STORE_INDEX* pIndex = (STORE_INDEX*)pWork;
+
+	store_base = 0;
+
+	result = f_open(&logFile, STORE_FILENAME, FA_OPEN_EXISTING | FA_READ);
+	if (result == FR_NO_FILE) return STORE_UNRESERVED;
+	if (result) {
+		printf_P(PSTR("f_open returned error code: %d\n"), result);
+		return STORE_ERROR;
+	}
+	if (f_size(&logFile) < STORE_SECTORS * 512) {
+		f_close(&logFile);
+		return STORE_UNRESERVED;
+	}
+
+	// Region must be a single fragment (cluster map of one run)
+	clmt[0] = 4;
+	logFile.cltbl = clmt;
+	result = f_lseek(&logFile, CREATE_LINKMAP);
+	logFile.cltbl = 0;
+	f_close(&logFile);
+
+	if (result == FR_NOT_ENOUGH_CORE) return STORE_FRAGMENTED;
+	if (result) return STORE_ERROR;
+
+	store_base = fs.database + (clmt[2] - 2) * fs.csize;
+
+	// Read log header (initialise new log)
+	if (disk_read(0, pWork, store_base, 1)) return STORE_ERROR;
+	if (memcmp_P(pIndex->ID, PSTR("LOG1"), 4)) {
+		store_generation = pIndex->generation + 1;	// Differ from any stale takes
+		store_number = 0;
+		write_header(pWork);
+	} else {
+		store_generation = pIndex->generation;
+		store_number = pIndex->number;
+	}
+
+	// Follow chain of takes to end of log
+	store_next = 1;
+	store_takes = 0;
+	while ((store_next < STORE_SECTORS) && (pIndex = read_index(store_next, pWork))) {
+		store_next += 1 + pIndex->pages;
+		store_takes++;
+	}
+
+	printf_P(PSTR("Log: %u takes, %lu of %lu sectors used\n"), store_takes, store_next, STORE_SECTORS);
+
+	return STORE_OK;
+}
+
+/**
+ * Function: store_clear
+ *
+ * Discards all takes in the log (starts a new generation).
+ *
+ * Parameters:
+ *    pWork - 512 byte work buffer.
+ */
+void store_clear(uint8_t* pWork) {
+	if (!store_base) return;
+
+	store_generation++;
+	store_number = 0;
+	store_takes = 0;
+	store_next = 1;
+	write_header(pWork);
+}
+
+/**
+ * Function: store_create
+ *
+ * Begins a new take at the end of the log. The index sector is skipped
+ * and written when the take is closed.
+ *
+ * Returns: Non-zero where successful (zero where log is full or not mounted).
+ */
+uint8_t store_create() {
+	if (!store_base || (store_next + 2 > STORE_SECTORS)) return 0;
+
+	store_sector = store_next + 1;
+
+	return 1;
+}
+
+/**
+ * Function: store_write
+ *
+ * Appends a page (one sector) to the take being recorded. No filesystem
+ * access is made.
+ *
+ * Parameters:
+ *    pPage - Pointer to 512 samples.
+ *
+ * Returns: Non-zero where successful (zero where log is full).
+ */
+uint8_t store_write(uint8_t* pPage) {
+	if (store_sector >= STORE_SECTORS) return 0;
+
+	if (disk_write(0, pPage, store_base + store_sector, 1)) {
+		printf_P(PSTR("disk_write returned error\n"));
+		return 0;
+	}
+	store_sector++;
+
+	return 1;
+}
+
+/**
+ * Function: store_close
+ *
+ * Ends the take being recorded, writing its index sector (making the
+ * take valid) and updating the log header.
+ *
+ * Parameters:
+ *    pWork - 512 byte work buffer.
+ */
+void store_close(uint8_t* pWork) {
+	STORE_INDEX* pIndex = (STORE_INDEX*)pWork;
+	uint32_t pages = store_sector - (store_next + 1);
+
+	if (!store_base || !pages) return;
+
+	store_number++;
+
+	memset(pWork, 0, 512);
+	memcpy_P(pIndex->ID, PSTR("TAKE"), 4);
+	pIndex->generation = store_generation;
+	pIndex->number = store_number;
+	pIndex->pages = pages;
+	pIndex->sampleRate = 15625;
+	if (disk_write(0, pWork, store_base + store_next, 1)) printf_P(PSTR("disk_write returned error\n"));
+
+	store_next = store_sector;
+	store_takes++;
+	write_header(pWork);
+
+	printf_P(PSTR("Log take %u: %lu pages\n"), store_number, pages);
+}
+
+/**
+ * Function: store_exportStart
+ *
+ * Begins export of a take to a WAVE file (TAKEnnn.WAV, nnn = take number).
+ * The file is created at its final size (clusters allocated at once) with
+ * a complete header, and closed; the audio data is copied by store_export.
+ *
+ * Parameters:
+ *    take - Take to export (1 = first take in log, 0 = last take).
+ *    pWork - 512 byte work buffer.
+ *
+ * Returns: Non-zero where export started.
+ */
+uint8_t store_exportStart(uint16_t take, uint8_t* pWork) {
+	FRESULT result;
+	FIL exportFile;
+	STORE_INDEX* pIndex = 0;
+	WAVE_HEADER header;
+	uint32_t sector = 1;
+	uint16_t bw;
+	char name[13];
+
+	if (!store_base || exportActive || !store_takes) return 0;
+	if (!take || (take > store_takes)) take = store_takes;
+
+	// Follow chain of takes to requested take
+	for (uint16_t i = 1; i <= take; i++) {
+		if (i > 1) sector += 1 + pIndex->pages;
+		if (!(pIndex = read_index(sector, pWork))) return 0;
+	}
+	exportSector = sector + 1;
+	exportRemaining = pIndex->pages;
+	exportNumber = pIndex->number;
+
+	// 15.625 kHz, 8-bit, mono PCM header for take
+	memcpy_P(header.fields.ChunkID, PSTR("RIFF"), 4);
+	memcpy_P(header.fields.Format, PSTR("WAVE"), 4);
+	memcpy_P(header.fields.fmtID, PSTR("fmt "), 4);
+	header.fields.fmtSize = 16;
+	header.fields.AudioFormat = WAVE_FORMAT_PCM;
+	header.fields.NumChannels = 1;
+	header.fields.SampleRate = pIndex->sampleRate;
+	header.fields.ByteRate = pIndex->sampleRate;
+	header.fields.BlockAlign = 1;
+	header.fields.BitsPerSample = 8;
+	memcpy_P(header.fields.dataID, PSTR("data"), 4);
+	header.fields.dataSize = exportRemaining * 512;
+	header.fields.ChunkSize = 512 - 8 + header.fields.dataSize;
+
+	export_name(name);
+
+	// Header sector: RIFF/fmt chunks, JUNK chunk padding, then data chunk
+	// header, so the pages of the take follow on sector boundaries
+	memset(pWork, 0, 512);
+	memcpy(pWork, header.bytes, 36);
+	memcpy_P(pWork + 36, PSTR("JUNK"), 4);
+	*(uint32_t*)(pWork + 40) = 512 - 36 - 16;
+	memcpy(pWork + 504, header.bytes + 36, 8);
+
+	result = f_open(&exportFile, name, FA_CREATE_ALWAYS | FA_WRITE);
+	if (result) {
+		printf_P(PSTR("f_open returned error code: %d\n"), result);
+		return 0;
+	}
+
+	// Allocate file at final size, then write header
+	result = f_lseek(&exportFile, 512 + header.fields.dataSize);
+	if (!result) result = f_lseek(&exportFile, 0);
+	if (!result) result = f_write(&exportFile, pWork, 512, &bw);
+	if (result) {
+		printf_P(PSTR("f_write returned error code: %d\n"), result);
+		f_close(&exportFile);
+		return 0;
+	}
+	result = f_close(&exportFile);
+	if (result) {
+		printf_P(PSTR("f_close returned error code: %d\n"), result);
+		return 0;
+	}
+
+	exportActive = 1;	// Pages copied by store_export (file reopened there)
+	printf_P(PSTR("Exporting %s (%lu pages)\n"), name, exportRemaining);
+
+	return 1;
+}
+
+/**
+ * Function: store_export
+ *
+ * Copies pages of the take being exported to its WAVE file. Called from
+ * idle time until complete; the file is closed once all pages are copied.
+ *
+ * Parameters:
+ *    pWork - 512 byte work buffer.
+ *
+ * Returns: Non-zero while pages remain to be exported.
+ */
+uint8_t store_export(uint8_t* pWork) {
+	FRESULT result = FR_OK;
+	uint16_t bw;
+
+	if (!exportActive) return 0;
+
+	// Reopen export file where suspended (file is at final size, remaining pages at its end)
+	if (!exportOpen) {
+		char name[13];
+
+		export_name(name);
+		result = f_open(&auxFile, name, FA_OPEN_EXISTING | FA_WRITE);
+		if (!result) result = f_lseek(&auxFile, f_size(&auxFile) - exportRemaining * 512);
+		if (result) {
+			printf_P(PSTR("f_open returned error code: %d\n"), result);
+			f_close(&auxFile);
+			exportActive = 0;
+			printf_P(PSTR("Export failed\n"));
+			return 0;
+		}
+		exportOpen = 1;
+	}
+
+	for (uint8_t n = STORE_EXPORT_PAGES; n && exportRemaining; n--) {
+		if (disk_read(0, pWork, store_base + exportSector, 1)) {
+			result = FR_DISK_ERR;
+			break;
+		}
+		result = f_write(&auxFile, pWork, 512, &bw);
+		if (result) break;
+
+		exportSector++;
+		exportRemaining--;
+	}
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+
+	if (result || !exportRemaining) {
+		exportActive = 0;
+		exportOpen = 0;
+		result = f_close(&auxFile);
+		if (result) printf_P(PSTR("f_close returned error code: %d\n"), result);
+		printf_P(exportRemaining ? PSTR("Export failed\n") : PSTR("Export complete\n"));
+	}
+
+	return exportActive;
+}
+
+/**
+ * Function: store_exportStop
+ *
+ * Abandons any export in progress, closing its WAVE file (the file keeps
+ * its full size; pages not yet copied are left unwritten).
+ */
+void store_exportStop() {
+	if (!exportActive) return;
+
+	exportActive = 0;
+	store_exportSuspend();
+	printf_P(PSTR("Export stopped\n"));
+}
+
+/**
+ * Function: store_exportSuspend
+ *
+ * Closes the export file (if open), releasing its file structure for use
+ * by the WAVE file interface. Export continues from the same page on the
+ * next call of store_export.
+ */
+void store_exportSuspend() {
+	FRESULT result;
+
+	if (!exportOpen) return;
+
+	exportOpen = 0;
+	result = f_close(&auxFile);
+	if (result) printf_P(PSTR("f_close returned error code: %d\n"), result);
+}
@@ -0,0 +1,46 @@
+/**
+ * store.h - EGB240DVR Library, Raw log store module header
+ *
+ * Append-only log of recorded pages in a reserved contiguous region of
+ * the SD card, with export of takes to WAVE files.
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+#define STORE_FILENAME		"EGB240.LOG"	// File reserving the log region
+#define STORE_SECTORS		16384UL			// Size of log region (sectors, 8 MB)
+#define STORE_EXPORT_PAGES	2				// Pages exported per call of store_export
+
+// Log header (first sector of region) and take index (first sector of each take)
+typedef struct {
+	char		ID[4];		// Contains "LOG1" (log header) or "TAKE" (take index) in ASCII
+	uint16_t	generation;	// Log generation (incremented when log is cleared)
+	uint16_t	number;		// Take number (index), or number of takes ever recorded (header)
+	uint32_t	pages;		// Pages of audio data following index (index only)
+	uint32_t	sampleRate;	// Sample rate of take (index only)
+} STORE_INDEX;
+
+// Result of store_mount
+#define STORE_OK			0	// Log region available
+#define STORE_FRAGMENTED	1	// Log file is not contiguous (format card, see wave_mkfs)
+#define STORE_ERROR			2	// File system or disk error
+#define STORE_UNRESERVED	3	// No log file of full size (format card, see store_reserve)
+
+extern uint16_t store_takes;	// Number of takes in log
+
+uint8_t store_reserve();				// Create log file reserving the log region (once the card is formatted)
+uint8_t store_mount(uint8_t* pWork);	// Locate log region and scan takes (512 byte work buffer)
+void store_clear(uint8_t* pWork);		// Discard all takes
+uint8_t store_create();					// Begin new take, returns zero where log is full
+uint8_t store_write(uint8_t* pPage);	// Append page to take, returns zero where log is full
+void store_close(uint8_t* pWork);		// End take (writes index sector)
+uint8_t store_exportStart(uint16_t take, uint8_t* pWork);	// Begin export of take to WAVE file (TAKEnnn.WAV)
+uint8_t store_export(uint8_t* pWork);	// Export pages of take, returns zero when complete
+void store_exportStop();				// Abandon export in progress (closes WAVE file)
+void store_exportSuspend();				// Close export file before other use of its file structure (export continues)
+
+#endif /* STORE_H_ */
@@ -10,6 +10,7 @@
  *
  * Requires:
  *   lib/fatfs - FatFs FAT file system library published by ChaN
+ *   sched - Scheduler, used to signal pushbutton events and sample CPU load
  *
  * Version: v1.0
  *    Date: 10/04/2016
@@ -22,10 +23,12 @@
 /************************************************************************/
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
  
 #include "lib/fatfs/diskio.h"
  
 #include "timer.h"
+#include "sched.h"
 
 /************************************************************************/
 /* GLOBAL VARIABLES                                                     */
@@ -33,8 +36,13 @@
 volatile uint8_t timer_fatfs = TIMER_INTERVAL_FATFS;	// Counter variable for servicing FatFs
 volatile uint16_t timer_led = TIMER_INTERVAL_LED;		// Counter for debug LED flashing
 volatile uint8_t timer_debounce = TIMER_INTERVAL_DEBOUNCE;	
+volatile uint8_t timer_ledHold = 0;	// LED flash intervals for which LED4 is held on (overload)
+
+volatile uint16_t timer_ticks = 0;	// Free running tick counter (64 us per tick)
+volatile uint16_t timer_uptime10 = 0;	// Time since boot (10 ms units, wraps after 655 s)
 
 volatile uint8_t pb_debounced = 0x00;
+volatile uint16_t pb_timestamp = 0;	// Tick count at last debounced pushbutton change
 volatile uint8_t reg1 = 0x00;
 volatile uint8_t reg2 = 0x00;
 
@@ -58,6 +66,37 @@ void timer_init() {
 	DDRD |= (1<<PIND7);		// Set PORTD7 (LED4) as output
 }
 
+/**
+ * Function: timer_now
+ * 
+ * Returns: The free running tick counter (64 us per tick, wraps every 4.19 s)
+ */
+uint16_t timer_now() {
+	uint16_t ticks;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ticks = timer_ticks;
+	}
+	
+	return ticks;
+}
+
+/**
+ * Function: timer_uptime
+ * 
+ * Returns: Time since boot in 10 ms units (wraps after 655 s). Used to time
+ *          events longer than the 4.19 s range of timer_now.
+ */
+uint16_t timer_uptime() {
+	uint16_t uptime;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uptime = timer_uptime10;
+	}
+	
+	return uptime;
+}
+
 /************************************************************************/
 /* INTERRUPT SERVICE ROUTINES                                           */
 /************************************************************************/
@@ -74,17 +113,26 @@ ISR(TIMER0_COMPA_vect) {
 	uint8_t pb;
 	uint8_t delta;
 	
+	timer_ticks++;
+	sched_tick();	// Sample main loop activity
 	
 	// Timer to service FatFs module (~10 ms interval)
 	if (!(--timer_fatfs)) {
 		timer_fatfs = TIMER_INTERVAL_FATFS;
+		timer_uptime10++;
 		disk_timerproc();
 	}
 	
 	// Timer to flash debug LED (1 Hz, 50% duty cycle flash)
+	// LED is held on instead while overload is indicated
 	if (!(--timer_led)) {
 		timer_led = TIMER_INTERVAL_LED;
-		PORTD ^= (1<<PIND7);
+		if (timer_ledHold) {
+			timer_ledHold--;
+			PORTD |= (1<<PIND7);
+		} else {
+			PORTD ^= (1<<PIND7);
+		}
 	}
 	
 	if (!(--timer_debounce)) {
@@ -93,9 +141,15 @@ ISR(TIMER0_COMPA_vect) {
 		pb = ~PINF;
 		delta = pb ^ pb_debounced;
 		pb_debounced ^= (reg2 & delta);
+		
+		// Signal application code when debounced state changes
+		if (reg2 & delta) {
+			pb_timestamp = timer_ticks;
+			sched_post(SCHED_EVT_BUTTON);
+		}
+		
 		reg2 = (reg1 & delta);
 		reg1 = delta;
-		
 	}
 	
 }
\ No newline at end of file
@@ -18,9 +18,16 @@
 #define TIMER_INTERVAL_LED		7813	// 500 ms interval
 #define TIMER_INTERVAL_DEBOUNCE 15  	// 10 ms interval
 
+#define TIMER_TICK_US			64		// Period of one tick (timer_now) in microseconds
+
+extern volatile uint16_t timer_ticks;
 extern volatile uint8_t pb_debounced;
+extern volatile uint16_t pb_timestamp;
 extern volatile uint8_t timer_fatfs;
+extern volatile uint8_t timer_ledHold;
 
 void timer_init();	// Initialise and start Timer0
+uint16_t timer_now();	// Returns free running tick counter (64 us per tick)
+uint16_t timer_uptime();	// Returns time since boot (10 ms units)
 
 #endif /* TIMER_H_ */
\ No newline at end of file
@@ -0,0 +1,141 @@
+/**
+ * codec_ratio.c - EGB240DVR host tool, lossless codec compression ratio
+ *
+ * Runs the firmware codec (codec.c, unmodified) on the host over the
+ * audio data of an 8-bit mono PCM WAVE file, one block per 512 sample
+ * page as recorded, and reports the compression ratio. Every block is
+ * decoded again and compared with the page, so the file is also a
+ * round trip check of the codec. Use a take recorded by the device
+ * (e.g. speech, with the codec off) to reproduce the ratio printed by
+ * codec_report on the target.
+ *
+ * The encode time per page (cycles) can only be measured on the target:
+ * record with the codec enabled (console 'c'), codec_report prints the
+ * average and worst case cycles per page at the end of the take.
+ *
+ * Build (from the repository root):
+ *   cc -O2 -Itools/host -I. -o codec_ratio tools/codec_ratio.c codec.c
+ *
+ * Usage:
+ *   codec_ratio TAKE.WAV
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wave.h"
+#include "codec.h"
+
+extern uint32_t codec_blocks;	// Blocks encoded since reset (codec.c)
+extern uint32_t codec_bytes;	// Bytes written since reset (codec.c)
+
+uint8_t* coded = 0;			// Coded data of current page (wave_write)
+uint32_t codedSize = 0;		// Bytes of coded data
+uint32_t codedRead = 0;		// Bytes of coded data read back (wave_read)
+uint32_t rawBlocks = 0;		// Blocks stored uncoded
+uint32_t kCount[CODEC_K_MAX + 1];	// Blocks coded with each Rice parameter
+
+// WAVE file interface used by the codec: coded data is held in memory
+void wave_write(uint8_t* pSamples, uint16_t count) {
+	coded = realloc(coded, codedSize + count);
+	memcpy(coded + codedSize, pSamples, count);
+	codedSize += count;
+}
+
+uint16_t wave_read(uint8_t* pSamples, uint16_t count) {
+	if (count > codedSize - codedRead) count = codedSize - codedRead;
+	memcpy(pSamples, coded + codedRead, count);
+	codedRead += count;
+	return count;
+}
+
+void wave_encoded(uint16_t samples) {
+	(void)samples;
+}
+
+uint16_t timer_now() {
+	return 0;
+}
+
+// Finds a chunk of a RIFF file, returns its size (file positioned at its body), 0 where none
+static uint32_t find_chunk(FILE* fp, const char* id) {
+	uint8_t hdr[8];
+
+	fseek(fp, 12, SEEK_SET);
+	while (fread(hdr, 1, 8, fp) == 8) {
+		uint32_t size = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | ((uint32_t)hdr[7] << 24);
+		if (!memcmp(hdr, id, 4)) return size;
+		fseek(fp, size + (size & 1), SEEK_CUR);
+	}
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	FILE* fp;
+	uint8_t fmt[16];
+	uint8_t page[CODEC_BLOCK_SAMPLES];
+	uint8_t check[CODEC_BLOCK_SAMPLES];
+	uint32_t dataSize;
+	uint32_t mismatches = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s TAKE.WAV\n", argv[0]);
+		return 2;
+	}
+
+	fp = fopen(argv[1], "rb");
+	if (!fp) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	// 8-bit mono PCM only (as recorded by the codec)
+	if ((find_chunk(fp, "fmt ") < 16) || (fread(fmt, 1, 16, fp) != 16)
+		|| ((fmt[0] | (fmt[1] << 8)) != WAVE_FORMAT_PCM) || (fmt[2] != 1) || (fmt[14] != 8)) {
+		fprintf(stderr, "%s: not an 8-bit mono PCM WAVE file\n", argv[1]);
+		return 1;
+	}
+	dataSize = find_chunk(fp, "data");
+
+	codec_reset();
+	while (dataSize >= CODEC_BLOCK_SAMPLES && fread(page, 1, CODEC_BLOCK_SAMPLES, fp) == CODEC_BLOCK_SAMPLES) {
+		CODEC_HEADER* pHeader;
+
+		dataSize -= CODEC_BLOCK_SAMPLES;
+
+		codedSize = 0;
+		codedRead = 0;
+		codec_encode(page);
+
+		pHeader = (CODEC_HEADER*)coded;
+		if (pHeader->k == CODEC_RAW) rawBlocks++; else kCount[pHeader->k]++;
+
+		if ((codec_decode(check) != CODEC_BLOCK_SAMPLES) || memcmp(page, check, CODEC_BLOCK_SAMPLES)
+			|| (codedRead != codedSize)) mismatches++;
+	}
+	fclose(fp);
+
+	if (!codec_blocks) {
+		fprintf(stderr, "%s: no whole pages of audio data\n", argv[1]);
+		return 1;
+	}
+
+	printf("Blocks: %u (%u raw)\n", (unsigned)codec_blocks, (unsigned)rawBlocks);
+	printf("Coded: %u of %u bytes, ratio %.2f:1, %.2f bits per sample\n",
+		(unsigned)codec_bytes, (unsigned)(codec_blocks * CODEC_BLOCK_SAMPLES),
+		(double)codec_blocks * CODEC_BLOCK_SAMPLES / codec_bytes,
+		8.0 * codec_bytes / ((double)codec_blocks * CODEC_BLOCK_SAMPLES));
+	printf("Rice parameter:");
+	for (int k = 0; k <= CODEC_K_MAX; k++) printf(" k%d %u", k, (unsigned)kCount[k]);
+	printf("\n");
+	printf("Round trip: %s (%u blocks differ)\n", mismatches ? "FAILED" : "exact", (unsigned)mismatches);
+
+	free(coded);
+	return mismatches ? 1 : 0;
+}
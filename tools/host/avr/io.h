@@ -0,0 +1,28 @@
+/**
+ * avr/io.h - Host build of EGB240DVR modules (tools only)
+ *
+ * Stands in for the avr-libc header so that modules without register
+ * access (codec) compile for the host. The SPI and port B registers used
+ * by the SD card driver are plain variables: the tool linking the driver
+ * defines them, and host_wait, which completes each SPI transfer against
+ * a model of the card (see tools/sd_boot.c). Not used by the firmware.
+ */
+
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTB, DDRB, SPCR, SPSR, SPDR;
+
+#define PINB0	0
+#define PINB1	1
+#define PINB2	2
+#define PINB7	7
+#define SPIF	7
+
+void host_wait(volatile uint8_t* sfr, uint8_t bit);	// Completes the access being waited on (e.g. SPI transfer)
+
+#define loop_until_bit_is_set(sfr, bit)	host_wait(&(sfr), (bit))
+
+#endif /* HOST_AVR_IO_H_ */
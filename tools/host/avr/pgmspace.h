@@ -0,0 +1,26 @@
+/**
+ * avr/pgmspace.h - Host build of EGB240DVR modules (tools only)
+ *
+ * Program memory is ordinary memory on the host: the _P functions map
+ * onto their standard library equivalents. Not used by the firmware.
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H_
+#define HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)				(s)
+#define pgm_read_byte(p)	(*(const uint8_t*)(p))
+#define pgm_read_word(p)	(*(const uint16_t*)(p))
+#define pgm_read_dword(p)	(*(const uint32_t*)(p))
+#define printf_P			printf
+#define sprintf_P			sprintf
+#define snprintf_P			snprintf
+#define memcpy_P			memcpy
+#define memcmp_P			memcmp
+
+#endif /* HOST_AVR_PGMSPACE_H_ */
@@ -0,0 +1,14 @@
+/**
+ * util/atomic.h - Host build of EGB240DVR modules (tools only)
+ *
+ * The host build is single threaded with no interrupts: atomic blocks
+ * run once, unguarded. Not used by the firmware.
+ */
+
+#ifndef HOST_UTIL_ATOMIC_H_
+#define HOST_UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type)	for (int atomic_once = 1; atomic_once; atomic_once = 0)
+
+#endif /* HOST_UTIL_ATOMIC_H_ */
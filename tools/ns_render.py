@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""
+ns_render.py - EGB240DVR host tool, noise shaping of 8-bit output
+
+Renders the 8-bit PWM output of the playback ISR (TIMER1_OVF_vect in
+main.c, single PWM output) for a test tone at each noise shaping order
+(ns_order 0, 1, 2) and reports the in-band SNR. The requantiser is a
+bit-exact model of the ISR: the volume-scaled sample (8-bit sample times
+the Q7 gain, 15 bits) plus the fed back error is truncated to 8 bits,
+the truncated fraction (Q7) is fed back as is (first order) or as twice
+itself less the previous one (second order).
+
+The error against the unquantised output (scaled sample / 128) is
+filtered by a 127-tap windowed-sinc low-pass (Blackman window) at the
+speech band edge and its power compared with that of the tone. The gain
+is held constant (no ramp). At unity gain there is no fraction, so the
+three orders are identical.
+
+Usage (Python 3, standard library only, takes a few seconds):
+  python3 tools/ns_render.py [GAIN ...]
+    GAIN - playback gain in 1/128 steps (default: 64 16 6)
+
+Version: v1.0
+   Date: 17/10/2026
+"""
+
+import math
+import sys
+
+FS = 15625			# Sample rate (Hz)
+TONE_HZ = 1000.0	# Test tone frequency (Hz)
+TONE_PEAK = 100		# Test tone peak (8-bit sample about midpoint, -2 dBFS)
+SAMPLES = 20000		# Samples rendered
+BAND_HZ = 3400.0	# Band edge of error measurement (Hz)
+TAPS = 127			# Taps of band filter
+
+
+# Test tone as played from an 8-bit WAVE file (signed about midpoint)
+def tone():
+	return [round(TONE_PEAK * math.sin(2 * math.pi * TONE_HZ * n / FS)) for n in range(SAMPLES)]
+
+
+# Windowed-sinc low-pass filter (Blackman window) with cut-off at BAND_HZ
+def band_filter():
+	fc = BAND_HZ / FS
+	h = []
+	for i in range(TAPS):
+		m = i - (TAPS - 1) / 2
+		s = 2 * fc if m == 0 else math.sin(2 * math.pi * fc * m) / (math.pi * m)
+		w = 0.42 - 0.5 * math.cos(2 * math.pi * i / (TAPS - 1)) + 0.08 * math.cos(4 * math.pi * i / (TAPS - 1))
+		h.append(s * w)
+	return h
+
+
+# Filters a signal, dropping the first TAPS samples (filter settling)
+def filtered(h, x):
+	return [sum(h[k] * x[n - k] for k in range(TAPS)) for n in range(TAPS, len(x))]
+
+
+# Requantises scaled samples (Q7) to 8 bits as the playback ISR, returns output levels
+def requantise(scaled, order):
+	out = []
+	feedback = 0	# ns_feedback
+	last = 0		# ns_last
+	for s in scaled:
+		level = s + feedback
+		error = level & 0x7F
+		out.append(max(-128, min(127, level >> 7)))
+		if order == 2:
+			feedback = (error << 1) - last
+		elif order:
+			feedback = error
+		last = error
+	return out
+
+
+def main(gains):
+	h = band_filter()
+	src = tone()
+
+	for gain in gains:
+		scaled = [s * gain for s in src]
+		ideal = [s / 128 for s in scaled]
+		signal = sum(v * v for v in ideal) / len(ideal)
+		results = []
+		for order in (0, 1, 2):
+			error = [o - i for o, i in zip(requantise(scaled, order), ideal)]
+			band = filtered(h, error)
+			noise = sum(v * v for v in band) / len(band)
+			results.append("%.1f" % (10 * math.log10(signal / noise)) if noise else "inf")
+		print("gain %3d/128: SNR off / 1st / 2nd order: %s dB" % (gain, " / ".join(results)))
+
+
+if __name__ == "__main__":
+	main([int(g) for g in sys.argv[1:]] or [64, 16, 6])
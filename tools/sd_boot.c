@@ -0,0 +1,266 @@
+/**
+ * sd_boot.c - EGB240DVR host tool, SD card boot-to-ready check
+ *
+ * Runs the SD card driver (lib/fatfs/mmc_avr.c, unmodified) on the host
+ * against a model of an SDHC card which stays in idle state (ACMD41
+ * returning R1 idle) for a given time after CMD0, i.e. a slow card.
+ * Time is simulated: each SPI byte takes 8 SPI clocks at the rate set in
+ * SPCR/SPSR (F_CPU 16 MHz), and disk_timerproc is called every 10 ms as
+ * by the Timer0 ISR. Each boot runs in a child process, so that the
+ * driver starts from its power-on state.
+ *
+ * For each card delay the blocking path (disk_initialize, as before) is
+ * compared with the deferred path used at boot (disk_start, then one
+ * disk_poll per main loop pass). Reported per card:
+ *   UI ready   - time the main loop starts servicing buttons
+ *   card ready - time disk_poll completes (as printed by the device,
+ *                "SD card ready: N ms after boot", in 10 ms units)
+ * Cards slower than the 1 s initialisation timeout must fail on both
+ * paths. Mounting (f_mount, FSINFO) is not modelled.
+ *
+ * Build (from the repository root):
+ *   cc -O2 -Itools/host -Ilib/fatfs -o sd_boot tools/sd_boot.c lib/fatfs/mmc_avr.c
+ *
+ * Usage:
+ *   sd_boot [CARD_MS [LOOP_US]]
+ *     CARD_MS - time the card stays idle after CMD0 (default: a range)
+ *     LOOP_US - duration of one main loop pass (default 1000)
+ *
+ * Version: v1.0
+ *    Date: 17/10/2026
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <avr/io.h>
+
+#include "diskio.h"
+
+#define F_CPU_MHZ		16			// CPU clock (MHz)
+#define TICK_US			10000		// disk_timerproc interval (us)
+#define INIT_TIMEOUT_MS	1000		// Initialisation timeout of the driver (Timer1 = 100)
+
+volatile uint8_t PORTB, DDRB, SPCR, SPSR, SPDR;	// Registers used by the driver
+
+uint64_t now;			// Simulated time (ns)
+uint64_t nextTick;		// Time of next disk_timerproc call (ns)
+uint32_t uptime10;		// Time since boot (10 ms units, timer_uptime)
+
+uint64_t cardDelay;		// Time the card stays idle after CMD0 (ns)
+uint64_t cardReady;		// Time the card leaves idle state (ns)
+uint8_t cardIdle;		// Card in idle state
+uint8_t cardApp;		// Next command is an application command (CMD55 received)
+uint8_t cardFrame[6];	// Command frame being received
+uint8_t cardIndex;		// Bytes of command frame received
+uint8_t cardOut[8];		// Response bytes queued
+uint8_t cardOutCount;	// Response bytes remaining
+uint8_t cardOutIndex;	// Next response byte
+uint32_t cardAcmd41;	// ACMD41 commands received
+
+// Outcome of one boot
+typedef struct {
+	uint64_t ui;		// Time main loop starts (ns)
+	uint64_t ready;		// Time initialisation completes (ns)
+	uint32_t log;		// Ready time printed by the device (ms)
+	uint32_t polls;		// Main loop passes polling the card
+	uint32_t acmd41;	// ACMD41 commands sent
+	int ok;				// Card initialised
+} BOOT;
+
+// Queues the response to a complete command frame (one byte of NCR first)
+static void card_command() {
+	uint8_t cmd = cardFrame[0] & 0x3F;
+	uint8_t app = cardApp;
+	uint8_t* pOut = cardOut;
+
+	cardApp = 0;
+	*pOut++ = 0xFF;
+
+	if (cmd == 0) {					// GO_IDLE_STATE
+		cardIdle = 1;
+		cardReady = now + cardDelay;
+		*pOut++ = 0x01;
+	} else if (cmd == 8) {			// SEND_IF_COND (SDv2, 2.7-3.6V)
+		*pOut++ = cardIdle;
+		*pOut++ = 0x00; *pOut++ = 0x00; *pOut++ = cardFrame[3]; *pOut++ = cardFrame[4];
+	} else if (cmd == 55) {			// APP_CMD
+		cardApp = 1;
+		*pOut++ = cardIdle;
+	} else if (app && cmd == 41) {	// SD_SEND_OP_COND
+		cardAcmd41++;
+		if (now >= cardReady) cardIdle = 0;
+		*pOut++ = cardIdle;
+	} else if (cmd == 58) {			// READ_OCR (powered up, CCS set)
+		*pOut++ = cardIdle;
+		*pOut++ = 0xC0; *pOut++ = 0xFF; *pOut++ = 0x80; *pOut++ = 0x00;
+	} else if (cmd == 16) {			// SET_BLOCKLEN
+		*pOut++ = cardIdle;
+	} else {						// Illegal command
+		*pOut++ = cardIdle | 0x04;
+	}
+
+	cardOutCount = pOut - cardOut;
+	cardOutIndex = 0;
+}
+
+// Returns the byte shifted out by the card while the given byte is shifted in
+static uint8_t card_exchange(uint8_t in) {
+	uint8_t out = 0xFF;
+
+	if (PORTB & (1<<PINB7)) {		// Not selected
+		cardIndex = 0;
+		cardOutCount = 0;
+		return 0xFF;
+	}
+
+	if (cardOutCount) {
+		out = cardOut[cardOutIndex++];
+		cardOutCount--;
+	}
+
+	if (cardIndex || ((in & 0xC0) == 0x40)) {	// Start or rest of a command frame
+		cardFrame[cardIndex++] = in;
+		if (cardIndex == 6) {
+			cardIndex = 0;
+			card_command();
+		}
+	}
+
+	return out;
+}
+
+// Advances simulated time, calling disk_timerproc every 10 ms (as the Timer0 ISR)
+static void advance(uint64_t ns) {
+	now += ns;
+	while (now >= nextTick) {
+		nextTick += TICK_US * 1000ULL;
+		uptime10++;
+		disk_timerproc();
+	}
+}
+
+// Completes an SPI transfer: one byte at the SPI clock rate of SPCR/SPSR
+void host_wait(volatile uint8_t* sfr, uint8_t bit) {
+	static const uint8_t divider[4] = { 4, 16, 64, 128 };
+	uint16_t div = divider[SPCR & 0x03] >> (SPSR & 0x01);
+
+	(void)sfr;
+	(void)bit;
+
+	advance(8ULL * div * 1000 / F_CPU_MHZ);
+	SPDR = card_exchange(SPDR);
+	SPSR |= (1<<SPIF);
+}
+
+// Powers up the simulated device with a card staying idle for the given time
+static void power_up(uint32_t cardMs) {
+	now = 0;
+	nextTick = TICK_US * 1000ULL;
+	uptime10 = 0;
+	cardDelay = cardMs * 1000000ULL;
+	cardReady = UINT64_MAX;
+	cardIdle = 1;
+	cardApp = 0;
+	cardIndex = 0;
+	cardOutCount = 0;
+	cardAcmd41 = 0;
+	PORTB = (1<<PINB7);
+}
+
+// Boots in a child process: blocking (disk_initialize, main loop starts once
+// it returns) or deferred (disk_start, then disk_poll once per loop pass)
+static int boot(uint32_t cardMs, uint32_t loopUs, int deferred, BOOT* pBoot) {
+	int fd[2], status;
+	pid_t pid;
+
+	if (pipe(fd)) return 0;
+	pid = fork();
+	if (pid < 0) return 0;
+
+	if (!pid) {
+		BOOT b = { 0 };
+
+		power_up(cardMs);
+		if (deferred) {
+			disk_start(0);
+			b.ui = now;
+			while (disk_poll(0)) {
+				b.polls++;
+				advance(loopUs * 1000ULL);
+			}
+		} else {
+			disk_initialize(0);
+			b.ui = now;
+		}
+		b.ok = !(disk_status(0) & STA_NOINIT);
+		b.ready = now;
+		b.log = uptime10 * 10;
+		b.acmd41 = cardAcmd41;
+		_exit(write(fd[1], &b, sizeof(b)) != sizeof(b));
+	}
+
+	close(fd[1]);
+	status = read(fd[0], pBoot, sizeof(*pBoot)) == sizeof(*pBoot);
+	close(fd[0]);
+	waitpid(pid, 0, 0);
+
+	return status;
+}
+
+// Checks both initialisation paths against a card, returns 0 where as expected
+static int check(uint32_t cardMs, uint32_t loopUs) {
+	BOOT blocking, deferred;
+	int expected;
+
+	if (!boot(cardMs, loopUs, 0, &blocking) || !boot(cardMs, loopUs, 1, &deferred)) {
+		perror("boot");
+		return 1;
+	}
+
+	printf("%5u ms card | blocking: UI %6.1f ms, card %-6s | deferred: UI %3.1f ms, card %-6s %6.1f ms (log %u ms), %u polls, %u ACMD41\n",
+		(unsigned)cardMs,
+		blocking.ui / 1e6, blocking.ok ? "ready" : "FAILED",
+		deferred.ui / 1e6, deferred.ok ? "ready" : "FAILED", deferred.ready / 1e6,
+		(unsigned)deferred.log, (unsigned)deferred.polls, (unsigned)deferred.acmd41);
+
+	// Slower cards than the timeout fail (margin of one timer tick either side)
+	if (cardMs + TICK_US / 1000 < INIT_TIMEOUT_MS) expected = 1;
+	else if (cardMs > INIT_TIMEOUT_MS + TICK_US / 1000) expected = 0;
+	else return 0;
+
+	if (blocking.ok != expected || deferred.ok != expected) return 1;
+
+	// Ready within one loop pass and a timer tick of the card leaving idle state
+	if (expected && deferred.ready > cardMs * 1000000ULL + (loopUs + TICK_US) * 1000ULL) return 1;
+
+	// Main loop not held up by the card
+	if (deferred.ui > TICK_US * 1000ULL) return 1;
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	static const uint32_t cards[] = { 0, 20, 100, 250, 500, 900, 1200 };
+	uint32_t loopUs = 1000;
+	int failures = 0;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [CARD_MS [LOOP_US]]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 2) loopUs = strtoul(argv[2], 0, 0);
+
+	if (argc > 1) {
+		failures += check(strtoul(argv[1], 0, 0), loopUs);
+	} else {
+		for (unsigned n = 0; n < sizeof(cards) / sizeof(cards[0]); n++)
+			failures += check(cards[n], loopUs);
+	}
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
@@ -10,6 +10,16 @@
  *   timer - Timer module, used to service the FatFs library
  *   serial - USB serial interface to provide debugging information
  *
+ * Playlist playback:
+ *   All WAVE files in the root directory may be played back-to-back in
+ *   directory order (wave_openList). While the current file plays, the
+ *   next file is opened and its header parsed into a standby file
+ *   structure (wave_prefetch). When the data of the current file is
+ *   exhausted wave_read continues from the standby file within the same
+ *   call, so transitions are sample accurate and incur no open/header
+ *   latency. Files not recorded in the format of this device (44 byte
+ *   header, 8-bit mono) are skipped.
+ *
  * Hardware resources:
  *   The WAVE file modules accesses an SD card via the SPI interface.
  *   This has been pre-configured in the FatFs library. Use of the SPI
@@ -30,6 +40,7 @@
 /************************************************************************/
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -38,12 +49,20 @@
 #include "lib/fatfs/diskio.h"
 
 #include "wave.h"
+#include "codec.h"
 
 /************************************************************************/
 /* GLOBAL VARIABLES                                                     */
 /************************************************************************/
 FATFS fs;	// File system structure for SD card access
 FIL file;	// File structure for WAVE file access
+FIL auxFile;	// File structure shared by one use at a time (see below)
+
+// Uses of auxFile (never together): standby file of playlist (playback),
+// checksum sidecar and next/previous segment (recording, the sidecar is
+// closed while a segment is held, see sum_suspend), checksum sidecar
+// (verify, the take is read through file) and export (store.c, suspended
+// by the application before any other use).
 
 WAVE_HEADER waveHeader;	// WAVE file header structure for read/write of WAVE file proerties
 
@@ -51,13 +70,92 @@ volatile uint32_t sampleCount = 0;	// Sample counter (used to finalise WAVE head
 
 uint8_t finaliseHeader = 0;			// Flag to indicate header must be updated/finalised
 
+uint32_t dataRemaining = 0;			// Bytes of audio data remaining to be read (wave_open)
+uint32_t trailerSize = 0;			// Bytes written after the data chunk (padding and chunks)
+const char* waveComment = 0;		// Comment to be stored in LIST/INFO chunk at finalisation
+
+uint16_t waveFormat = WAVE_FORMAT_PCM;	// Audio format of files created by wave_create
+uint8_t waveChannels = 1;			// Number of channels of files created by wave_create
+
+uint8_t listActive = 0;				// Flag to indicate playlist playback is active
+uint8_t nextQueued = 0;				// Flag to indicate next file is open (standby, auxFile)
+uint8_t waveRepeat = 0;				// Flag to return to start of data at end of file (repeat mode)
+uint8_t waveCard = WAVE_CARD_BUSY;	// State of SD card initialisation
+uint8_t waveReuse = 1;				// Flag to record into existing (preallocated) take file
+uint8_t waveErase = 1;				// Flag to pre-erase the take file while idle
+uint8_t eraseActive = 0;			// Flag to indicate take file is being pre-erased
+uint8_t eraseOpen = 0;				// Flag to indicate file is open for pre-erase (closed before other use)
+uint32_t eraseOffset = 0;			// Offset of take file to continue pre-erase from
+uint32_t eraseCluster = 0;			// Last cluster pre-erased (cursor of f_erase, 0 = follow chain)
+uint32_t junkData = 0;				// Offset of JUNK chunk body (unused part of take file)
+uint8_t waveSegment = 0;			// Flag to record in segments (see wave_rollover)
+uint8_t segment = 0;				// Number of current segment of take (0 = take file)
+uint8_t segNext = 0;				// Flag to indicate next segment is created (header written, closed)
+uint8_t segPending = 0;				// Flag to indicate previous segment awaits finalisation (auxFile)
+uint8_t segClear = 0;				// Next segment left by a longer take to empty (0 = none, see segment_clear)
+uint8_t sumOpen = 0;				// Flag to indicate checksum sidecar is in use (recording)
+uint8_t sumHeld = 0;				// Flag to indicate checksum sidecar is open (auxFile)
+uint32_t sumSize = 0;				// Bytes of checksum sidecar written for current take
+uint16_t sumS1 = 0;					// Running sum of bytes of current page
+uint16_t sumS2 = 0;					// Running sum of sumS1 of current page
+WAVE_SUM_RECORD sumStage[WAVE_SUM_STAGE / sizeof(WAVE_SUM_RECORD)];	// Records awaiting write to sidecar
+uint8_t sumStaged = 0;				// Number of records staged
+uint8_t verifyActive = 0;			// Flag to indicate verify is in progress (file, auxFile open)
+
+// State of recording, playback and verify (never in use together)
+union {
+	struct {
+		WAVE_SEEK seek;					// Seek table of created file (encoded formats)
+		uint8_t seekCount;				// Entries in seek table
+		uint32_t markers[WAVE_MARKERS];	// Sample positions of markers
+		uint8_t markerCount;			// Markers of created file
+		uint32_t encodedSamples;		// Samples represented by encoded data (non-PCM formats)
+		uint32_t segData;				// Size of audio data of previous segment
+		uint32_t segTrailer;			// Bytes following data chunk of previous segment
+		uint32_t segBase;				// Samples recorded in previous segments of take
+	} rec;							// Recording (wave_create to wave_close, and recovery)
+	struct {
+		DWORD clmt[WAVE_CLMT_SIZE];		// Cluster map of open file (fast seek)
+		DIR listDir;					// Directory of playlist
+		uint32_t nextData;				// Size of audio data of standby file
+		uint16_t nextFormat;			// Audio format of standby file
+		uint8_t seekLoaded;				// Flag to indicate seek table has been located (wave_seek)
+		uint8_t seekEntries;			// Entries in seek table of open file
+		uint32_t seekChunk;				// Offset of seek table of open file (0 where file has none)
+		uint32_t seekInterval;			// Samples between entries of seek table of open file
+	} play;							// Playback (wave_open/wave_openList to wave_close)
+	struct {
+		uint8_t seg;					// Number of segment being verified
+		uint8_t blocks;					// Flag to indicate data is encoded (a page per block)
+		uint8_t bad;					// Flag to indicate a damaged range is open
+		uint32_t remaining;				// Audio data remaining in segment being verified
+		uint32_t pages;					// Pages verified
+		uint32_t damaged;				// Pages failing verification
+		uint32_t badStart;				// First page of current damaged range
+	} verify;						// Verify (wave_verifyStart to end of verify)
+} waveState;
+
 /************************************************************************/
 /* FUNCTION PROTOTYPES                                                  */
 /************************************************************************/
 void write_wave_header();
-uint32_t read_wave_header();
-void finalise_wave_header();
+uint32_t read_wave_header(FIL* fp, WAVE_HEADER* pHeader);
+void finalise_wave_header(FIL* fp, uint32_t dataSize, uint32_t trailer);
+uint8_t finish_data();
 void initialise_header(uint32_t samplerate, uint8_t bps, uint8_t channels);
+void write_trailer();
+void write_junk();
+void erase_start(uint32_t offset);
+void erase_stop();
+void erase_suspend();
+void write_cues();
+void segment_end();
+void segment_clear();
+uint8_t recover_take(uint8_t number);
+void sum_open();
+void sum_close();
+void sum_suspend();
+void verify_stop();
 
 /************************************************************************/
 /* PRIVATE/UTILLITY FUNCTIONS                                           */
@@ -71,14 +169,30 @@ void initialise_header(uint32_t samplerate, uint8_t bps, uint8_t channels);
  * 
  * Parameters:
  *   array - Destination array.
- *   string - Source string.
+ *   string - Source string (in program memory, see PSTR).
  */
-void set_char_array(char* array, char* string) {
+void set_char_array(char* array, const char* string) {
 	for (int i = 0; i < 4; i++) {
-		array[i] = string[i];
+		array[i] = pgm_read_byte(&string[i]);
 	}
 }
 
+/**
+ * Function: write_id
+ * 
+ * Utility function. Writes a four character chunk ID (in program memory,
+ * see PSTR) to the WAVE file.
+ *
+ * Returns: Result of f_write.
+ */
+FRESULT write_id(const char* id) {
+	char chunkID[4];
+	uint16_t bw;
+	
+	set_char_array(chunkID, id);
+	return f_write(&file, chunkID, 4, &bw);
+}
+
 /**
  * Function: initialise_header
  * 
@@ -92,20 +206,20 @@ void set_char_array(char* array, char* string) {
  *   channels - Number of audio channels (1 = mono, 2 = stereo, ...).
  */
 void initialise_header(uint32_t samplerate, uint8_t bps, uint8_t channels) {
-	set_char_array(waveHeader.fields.ChunkID, "RIFF");
+	set_char_array(waveHeader.fields.ChunkID, PSTR("RIFF"));
 	waveHeader.fields.ChunkSize = 0;	// placeholder, update when number of samples is known (36 + dataSize)
-	set_char_array(waveHeader.fields.Format, "WAVE");
+	set_char_array(waveHeader.fields.Format, PSTR("WAVE"));
 	
-	set_char_array(waveHeader.fields.fmtID, "fmt ");	
+	set_char_array(waveHeader.fields.fmtID, PSTR("fmt "));	
 	waveHeader.fields.fmtSize = 16;		// for PCM
-	waveHeader.fields.AudioFormat = 1;	// PCM
+	waveHeader.fields.AudioFormat = waveFormat;	// PCM (or encoded, see wave_format)
 	waveHeader.fields.NumChannels = channels;
 	waveHeader.fields.SampleRate = samplerate;
 	waveHeader.fields.ByteRate = samplerate*channels*(bps>>3);
 	waveHeader.fields.BlockAlign = channels*(bps>>3);
 	waveHeader.fields.BitsPerSample = bps;
 	
-	set_char_array(waveHeader.fields.dataID, "data");
+	set_char_array(waveHeader.fields.dataID, PSTR("data"));
 	waveHeader.fields.dataSize = 0;		// placeholder, update with NumSamples * BlockAlign
 }
 
@@ -113,18 +227,21 @@ void initialise_header(uint32_t samplerate, uint8_t bps, uint8_t channels) {
  * Function: write_wave_header
  * 
  * Writes a WAVE header structure into an open file.
- * Wave configuration is hardcoded to 15625 samples per second, 8 bits per sample, mono.
+ * Wave configuration is 8 bits per sample, 15625 samples per second mono. Where
+ * more channels are selected (wave_channels) the ADC alternates between them,
+ * so the frame rate is divided by the number of channels (7812 Hz stereo; the
+ * true rate of 7812.5 Hz cannot be represented, an error of 64 ppm).
  */
 void write_wave_header() {
 	FRESULT result;
 	uint16_t bw;
 	
-	initialise_header(15625, 8, 1);	// Create header for 15.625 kHz, 8-bit per sample, mono WAVE file
+	initialise_header(15625 / waveChannels, 8, waveChannels);	// Create header for 15.625 kHz (shared by channels), 8-bit per sample
 	result = f_write(&file, &(waveHeader.bytes), 44, &bw); // Write header to file
 
 	// If error has occurred, write status to console
-	if (result) printf("f_write returned error code: %d\n", result);
-	if (bw != 44) printf("f_write wrote %d of 44 bytes to file.", bw);
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+	if (bw != 44) printf_P(PSTR("f_write wrote %d of 44 bytes to file."), bw);
 	
 	// Flag that header requires finalisation
 	finaliseHeader = 1;
@@ -135,185 +252,1896 @@ void write_wave_header() {
  * 
  * Reads a WAVE header from an open file into a structure.
  * 
+ * Parameters:
+ *   fp - Pointer to open file.
+ *   pHeader - Pointer to structure to receive header.
+ *
  * Returns: The number of samples in the opened wave file (as reported in the header)
  */
-uint32_t read_wave_header() {
+uint32_t read_wave_header(FIL* fp, WAVE_HEADER* pHeader) {
 	FRESULT result;
 	uint16_t br;
 	
 	// Read header from WAVE file into structure
-	result = f_read(&file, &(waveHeader.bytes), 44, &br);
+	result = f_read(fp, &(pHeader->bytes), 44, &br);
 
 	// If error has occurred, write status to console
-	if (result) printf("f_read returned error code: %d\n", result);
-	if (br != 44) printf("f_read read %d of 44 bytes from file.", br);
+	if (result) printf_P(PSTR("f_read returned error code: %d\n"), result);
+	if (br != 44) printf_P(PSTR("f_read read %d of 44 bytes from file."), br);
 	
 	
 	if (result | (br != 44)) {
 		// Return "empty" wave file if read is unsuccessful
 		return 0;
 	} else {
-		return waveHeader.fields.dataSize;
+		return pHeader->fields.dataSize;
 	}
 }
 
+/**
+ * Function: write_junk
+ * 
+ * Extends a reused take file to WAVE_SLOT_BYTES (allocating clusters for
+ * the next take), or cuts a larger file to that size, and covers the
+ * remainder of the file, beyond the chunks already written, with a JUNK
+ * chunk so the file remains valid RIFF.
+ */
+void write_junk() {
+	FRESULT result;
+	uint16_t bw;
+	uint8_t pad = 0;
+	uint32_t start = f_tell(&file);
+	uint32_t size;
+	
+	// Preallocate slot for next take (cluster chain created, data not written),
+	// or release clusters beyond the slot (freed in the background); data
+	// already written is never cut
+	if ((f_size(&file) != WAVE_SLOT_BYTES) && (start <= WAVE_SLOT_BYTES)) {
+		result = f_lseek(&file, WAVE_SLOT_BYTES);
+		if (result) {
+			printf_P(PSTR("f_lseek returned error code: %d\n"), result);
+		} else if (f_size(&file) > WAVE_SLOT_BYTES) {
+			result = f_cut(&file);
+			if (result) printf_P(PSTR("f_cut returned error code: %d\n"), result);
+		}
+		f_lseek(&file, start);
+	}
+	
+	// JUNK chunk body covers the rest of the file (header extends a short file)
+	size = f_size(&file) - start;
+	size = (size < 8) ? 0 : size - 8;
+	
+	result = write_id(PSTR("JUNK"));
+	if (!result) result = f_write(&file, &size, 4, &bw);
+	if (!result && (size & 1)) {
+		result = f_lseek(&file, start + 8 + size);	// Pad byte at end of file
+		if (!result) result = f_write(&file, &pad, 1, &bw);
+	}
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+	
+	trailerSize += 8 + size + (size & 1);
+	junkData = start + 8;
+}
+
+/**
+ * Function: erase_start
+ * 
+ * Begins pre-erase of the take file from an offset to the end of the file
+ * (continued in batches by wave_erase, which opens the file), so the next
+ * take is written to erased blocks.
+ *
+ * Parameters:
+ *    offset - Offset of first byte that may be erased.
+ */
+void erase_start(uint32_t offset) {
+	erase_stop();
+	
+	if (!waveErase) return;
+	
+	eraseOffset = offset;
+	eraseCluster = 0;
+	eraseActive = 1;
+}
+
+/**
+ * Function: erase_suspend
+ * 
+ * Closes the take file opened for pre-erase, so it is not open for write
+ * while read for playback (there is no file locking). Pre-erase uses the
+ * file structure of the WAVE file (free while stopped), so it is suspended
+ * before any file is opened with it. Pre-erase resumes from the same offset
+ * on the next call of wave_erase.
+ */
+void erase_suspend() {
+	if (!eraseOpen) return;
+	
+	eraseOpen = 0;
+	f_close(&file);
+}
+
+/**
+ * Function: erase_stop
+ * 
+ * Ends (or abandons) pre-erase of the take file.
+ */
+void erase_stop() {
+	eraseActive = 0;
+	erase_suspend();
+}
+
 /**
  * Function: finalise_wave_header
  * 
  * Finalises the header of an open WAVE file on the basis of the number of samples written to the file.
+ *
+ * Parameters:
+ *    fp - Pointer to file (the take file, or a previous segment).
+ *    dataSize - Size of audio data written to the file (bytes).
+ *    trailer - Bytes written after the data chunk (see write_trailer).
  */
-void finalise_wave_header() {
+void finalise_wave_header(FIL* fp, uint32_t dataSize, uint32_t trailer) {
 	FRESULT result;
 	uint16_t bw;
 	
 	// Calculate header fields to update
-	uint32_t dataSize = sampleCount;
-	uint32_t chunkSize = 36 + dataSize;
+	uint32_t chunkSize = 36 + dataSize + trailer;
 	
 	// Finalise wave file header
 	// Where errors occur, print to console
-	result = f_lseek(&file, 4);						// Seek to dataSize location
-	if (result) printf("f_lseek returned error code: %d\n", result);
-	result = f_write(&file, &chunkSize, 4, &bw);	// Write dataSize field to file
-	if (result) printf("f_write returned error code: %d\n", result);
-	if (bw != 4) printf("f_write wrote %d of 4 bytes to file.", bw);
+	result = f_lseek(fp, 4);						// Seek to dataSize location
+	if (result) printf_P(PSTR("f_lseek returned error code: %d\n"), result);
+	result = f_write(fp, &chunkSize, 4, &bw);		// Write dataSize field to file
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+	if (bw != 4) printf_P(PSTR("f_write wrote %d of 4 bytes to file."), bw);
 	
-	result = f_lseek(&file, 40);					// Seek to chunkSize location
-	if (result) printf("f_lseek returned error code: %d\n", result);
-	result = f_write(&file, &dataSize, 4, &bw);		// Write chuckSize field to file
-	if (result) printf("f_write returned error code: %d\n", result);
-	if (bw != 4) printf("f_write wrote %d of 4 bytes to file.", bw);
+	result = f_lseek(fp, 40);						// Seek to chunkSize location
+	if (result) printf_P(PSTR("f_lseek returned error code: %d\n"), result);
+	result = f_write(fp, &dataSize, 4, &bw);		// Write chuckSize field to file
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+	if (bw != 4) printf_P(PSTR("f_write wrote %d of 4 bytes to file."), bw);
 }
 
-/************************************************************************/
-/* PUBLIC/USER FUNCTIONS                                                */
-/************************************************************************/
-
 /**
- * Function: wave_init
+ * Function: write_chunk
  * 
- * Initialises the WAVE module for use. Mounts the SD card for filesystem access.
- * Must be called prior to calling any other function in the WAVE module.
+ * Appends a RIFF chunk at the current position of an open file, padding the
+ * chunk body to an even length. The size of the chunk is added to trailerSize.
+ * 
+ * Parameters:
+ *   id - Chunk identifier (four characters, in program memory, see PSTR).
+ *   pData - Pointer to chunk body.
+ *   size - Size of chunk body in bytes (excluding padding).
  */
-void wave_init() {
+void write_chunk(const char* id, const void* pData, uint32_t size) {
 	FRESULT result;
+	uint16_t bw;
+	uint8_t pad = 0;
 	
-	result = f_mount(&fs, "/", 1);	// force mount SD card root directory
-
-	// If error occurs, write status to console
-	if (result) printf("f_mount returned error code: %d\n", result);
+	result = write_id(id);
+	if (!result) result = f_write(&file, &size, 4, &bw);
+	if (!result) result = f_write(&file, pData, size, &bw);
+	if (!result && (size & 1)) result = f_write(&file, &pad, 1, &bw);
+	
+	// If error has occurred, write status to console
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+	
+	trailerSize += 8 + size + (size & 1);
 }
 
 /**
- * Function: wave_create
+ * Function: write_trailer
  * 
- * Creates a and initialises a WAVE file for read/write access.
- * The WAVE filename is hardcoded to "EGB240.WAV"
- * If a file with the same name exists it is overwritten and cleared.
- * The created WAVE file is initialised with an empty header.
- *
- * Postcondition:
- *    Creating a wave file resets the sample counter.
+ * Writes any chunks which follow the data chunk of a newly created WAVE file.
+ * The data chunk is padded to an even length where required. For encoded
+ * (non-PCM) formats a fact chunk records the number of samples. Where a comment
+ * has been supplied (wave_comment) it is written to a LIST/INFO chunk as ICMT.
  */
-void wave_create() {
+void write_trailer() {
 	FRESULT result;
+	uint16_t bw;
+	uint8_t pad = 0;
 	
-	// Create new WAVE file with read/write access (force overwrite if file exists)
-	result = f_open(&file, "EGB240.WAV", FA_CREATE_ALWAYS | FA_READ | FA_WRITE);
-
-	// If error occurs, write status to console
-	if (result) printf("f_open returned error code: %d\n", result);
+	trailerSize = 0;
 	
-	// Write WAVE file header to file
-	write_wave_header();
+	// RIFF chunks must be word aligned
+	if (sampleCount & 1) {
+		result = f_write(&file, &pad, 1, &bw);
+		if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+		trailerSize = 1;
+	}
 	
-	// Reset sample counter
-	sampleCount = 0;
+	if (waveHeader.fields.AudioFormat != WAVE_FORMAT_PCM) {
+		write_chunk(PSTR("fact"), &waveState.rec.encodedSamples, 4);
+		write_chunk(PSTR("seek"), &waveState.rec.seek, 4 + 4*(uint32_t)waveState.rec.seekCount);
+	}
+	
+	if (waveState.rec.markerCount) write_cues();
+	
+	if (waveComment) {
+		uint32_t textSize = strlen(waveComment) + 1;	// ICMT is null terminated
+		uint32_t listSize = 4 + 8 + textSize + (textSize & 1);
+		
+		result = write_id(PSTR("LIST"));
+		if (!result) result = f_write(&file, &listSize, 4, &bw);
+		if (!result) result = write_id(PSTR("INFO"));
+		if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+		trailerSize += 12;
+		
+		write_chunk(PSTR("ICMT"), waveComment, textSize);
+		waveComment = 0;
+	}
 }
 
 /**
- * Function: wave_open
+ * Function: finish_data
  * 
- * Opens an existing WAVE file for read only access.
- * The WAVE filename is hardcoded to "EGB240.WAV"
+ * Completes the body of a newly created WAVE file: writes the trailing chunks
+ * (write_trailer), then covers (reused take file) or cuts any previous take
+ * beyond them. Segments other than the first are newly created, so are
+ * neither preallocated nor cut. A first segment longer than the slot is
+ * cut at its end, as where the take file is not reused.
  *
- * Returns: The number of samples in the opened WAVE file.
+ * Returns: 1 where the remainder of the file is covered by a JUNK chunk (see write_junk).
  */
-uint32_t wave_open() {
+uint8_t finish_data() {
 	FRESULT result;
 	
-	// Open an existing WAVE file with read only access
-	result = f_open(&file, "EGB240.WAV", FA_READ);
+	write_trailer();
+	
+	if (waveReuse && !segment && (f_tell(&file) <= WAVE_SLOT_BYTES)) {
+		write_junk();	// Cover previous take beyond the new data
+		return 1;
+	}
+	
+	if (f_size(&file) > f_tell(&file)) {
+		// Cut previous take beyond the new data (freed in the background)
+		result = f_cut(&file);
+		if (result) printf_P(PSTR("f_cut returned error code: %d\n"), result);
+	}
+	
+	return 0;
+}
 
-	// If error occurs, write status to console
-	if (result) printf("f_open returned error code: %d\n", result);
+/**
+ * Function: segment_name
+ * 
+ * Utility function. Returns the filename of a segment of a take: the first
+ * segment is the take file, subsequent segments are numbered EGB24001.WAV
+ * to EGB24099.WAV.
+ */
+void segment_name(char* name, uint8_t number) {
+	if (number) {
+		sprintf_P(name, PSTR("EGB240%02u.WAV"), number);
+	} else {
+		strcpy(name, "EGB240.WAV");
+	}
+}
+
+/**
+ * Function: swap_files
+ * 
+ * Utility function. Exchanges the file structures of the current file and
+ * the shared file (no third structure is held).
+ */
+void swap_files() {
+	uint8_t* pA = (uint8_t*)&file;
+	uint8_t* pB = (uint8_t*)&auxFile;
 	
-	// Read the WAVE file header and return the number of samples reported
-	return read_wave_header();
+	for (uint8_t i = 0; i < sizeof(FIL); i++) {
+		uint8_t t = pA[i];
+		pA[i] = pB[i];
+		pB[i] = t;
+	}
 }
 
 /**
- * Function: wave_close
+ * Function: segment_finalise
  * 
- * Closes an open WAVE file. If required, the WAVE file header is finalised prior to closing.
+ * Utility function. Finalises the header of the previous segment and
+ * closes it (deferred from wave_rollover).
  */
-void wave_close() {
+void segment_finalise() {
 	FRESULT result;
 	
-	if (finaliseHeader) {
-		// Only finalise header where WAVE file is newly created 
-		finaliseHeader = 0;
-		finalise_wave_header();
+	if (!segPending) return;
+	segPending = 0;
+	
+	finalise_wave_header(&auxFile, waveState.rec.segData, waveState.rec.segTrailer);
+	result = f_close(&auxFile);
+	if (result) printf_P(PSTR("f_close returned error code: %d\n"), result);
+}
+
+/**
+ * Function: segment_end
+ * 
+ * Utility function. Ends segmented recording: finalises the previous
+ * segment, then schedules the created next segment and any segments left
+ * by a longer take to be emptied while stopped (segment_clear), so only
+ * this take plays. Call once the checksum sidecar is closed (auxFile is
+ * used).
+ */
+void segment_end() {
+	sum_suspend();
+	segment_finalise();
+	segNext = 0;		// Header only, emptied by segment_clear
+	
+	if (!segment && !waveSegment) return;	// Any earlier schedule continues
+	
+	segClear = (segment < WAVE_SEGMENTS_MAX) ? segment + 1 : 0;
+	segment = 0;
+	waveState.rec.segBase = 0;
+}
+
+/**
+ * Function: segment_clear
+ * 
+ * Utility function. Empties the next segment left after the end of the
+ * last take (see segment_end). Emptied files are kept (zero length); the
+ * cut chain is queued and freed in batches by wave_reclaim, so no
+ * cluster chain is freed here. Uses the WAVE file structure, free while
+ * stopped (pre-erase reopens the take file afterwards). Waits while the
+ * queue of chains pending removal is full.
+ */
+void segment_clear() {
+	char name[13];
+	
+	if (fs.reclaim[_RECLAIM_QUEUE - 1]) return;	// Queue full, wait for wave_reclaim
+	
+	erase_suspend();
+	segment_name(name, segClear);
+	if (f_open(&file, name, FA_OPEN_EXISTING | FA_WRITE)) {
+		segClear = 0;	// No further segments
+		return;
 	}
+	if (f_size(&file)) f_cut(&file);	// File pointer at start, cut whole file
+	f_close(&file);
 	
-	// Close WAVE file
-	result = f_close(&file);
+	segClear = (segClear < WAVE_SEGMENTS_MAX) ? segClear + 1 : 0;
+}
 
-	// If error occurs, write status to console
-	if (result) printf("f_close returned error code: %d\n", result);
+/**
+ * Function: sector_erased
+ * 
+ * Utility function. Checks whether a sector of the take file is erased (not
+ * yet written): the whole sector is all 0x00 or all 0xFF, as left by
+ * pre-erase (see wave_erase). The sector is read WAVE_RECOVER_PROBE bytes
+ * at a time (one disk read, held in the file system window).
+ *
+ * Returns: 1 if the sector reads as erased, otherwise 0.
+ */
+uint8_t sector_erased(uint32_t sector) {
+	uint8_t probe[WAVE_RECOVER_PROBE];
+	uint16_t br;
+	uint8_t fill = 0;
+	
+	if (f_lseek(&file, sector * 512)) return 1;
+	
+	for (uint16_t n = 0; n < 512; n += WAVE_RECOVER_PROBE) {
+		if (f_read(&file, probe, WAVE_RECOVER_PROBE, &br) || (br != WAVE_RECOVER_PROBE)) return 1;
+		if (!n) {
+			fill = probe[0];
+			if ((fill != 0x00) && (fill != 0xFF)) return 0;
+		}
+		for (uint8_t i = 0; i < WAVE_RECOVER_PROBE; i++) {
+			if (probe[i] != fill) return 0;
+		}
+	}
+	
+	return 1;
 }
 
 /**
- * Function: wave_write
+ * Function: recover_take
  * 
- * Writes a number of audio samples into a open WAVE file.
- * This function expects 8-bit audio samples.
+ * Utility function. Detects a take (or segment of a take) left unfinalised
+ * by power loss during recording (header sizes still zero, see
+ * initialise_header) and finalises it. The directory size of the file is
+ * not updated while recording, so the extent of the cluster chain is found
+ * (f_extent) and the end of the audio data located:
+ *
+ *   PCM - binary search for the first erased sector. Audio can read as
+ *         erased (a full sector of clipped samples), so the boundary is
+ *         confirmed by the WAVE_RECOVER_CONFIRM sectors following it; where
+ *         one holds data, the search resumes beyond it.
+ *   Encoded - the block chain is followed (size fields) to the last whole
+ *         block, as quiet blocks are small and may read as erased.
+ *
+ * The file is then closed as for a normal take (wave_close), which patches
+ * the RIFF sizes and the directory entry; a first segment longer than the
+ * reused slot is cut at its end rather than covered (see finish_data).
+ *
+ * Where the take file was not pre-erased, data of the previous take (or
+ * cluster slack) beyond the end of the interrupted take is kept.
  *
  * Parameters:
- *    pSamples - Pointer to array of 8-bit audio samples to write to WAVE file.
- *    count - Number of samples to write from array into WAVE file.
+ *    number - Segment to check (0 = take file, see segment_name).
+ *
+ * Returns: 1 where the file exists and is finalised (check the next
+ * segment), otherwise 0.
  */
-void wave_write(uint8_t* pSamples, uint16_t count) {
+uint8_t recover_take(uint8_t number) {
+	char name[13];
+	uint32_t lo = 0;
+	uint32_t hi;
+	uint32_t end;
+	uint16_t br;
+	
+	segment_name(name, number);
+	if (f_open(&file, name, FA_READ | FA_WRITE)) return 0;
+	
+	// Unfinalised take has a valid header with zero sizes
+	if ((f_read(&file, &(waveHeader.bytes), 44, &br) || (br != 44))
+		|| memcmp_P(waveHeader.fields.ChunkID, PSTR("RIFF"), 4) || memcmp_P(waveHeader.fields.dataID, PSTR("data"), 4)) {
+		f_close(&file);
+		return 0;
+	}
+	if (waveHeader.fields.ChunkSize || waveHeader.fields.dataSize) {
+		f_close(&file);
+		return 1;
+	}
+	
+	// Allow reads to end of cluster chain (may be longer than the directory size)
+	if (f_extent(&file)) {
+		f_close(&file);
+		return 0;
+	}
+	end = (f_size(&file) + 511) >> 9;	// Sectors in chain
+	waveState.rec.encodedSamples = 0;
+	
+	if (waveHeader.fields.AudioFormat == WAVE_FORMAT_PCM) {
+		// Sector 0 holds the header, find first erased sector followed by erased sectors
+		hi = end;
+		while ((hi - lo) > 1) {
+			uint32_t mid = (lo + hi) >> 1;
+			
+			if (sector_erased(mid)) {
+				hi = mid;
+			} else {
+				lo = mid;
+			}
+			
+			if ((hi - lo) <= 1) {
+				for (uint32_t s = hi + 1; (s < end) && (s <= hi + WAVE_RECOVER_CONFIRM); s++) {
+					if (!sector_erased(s)) {
+						lo = s;		// Erased run within the data, search beyond it
+						hi = end;
+						break;
+					}
+				}
+			}
+		}
+		sampleCount = (hi << 9) - 44;
+		if (waveHeader.fields.BlockAlign) sampleCount -= sampleCount % waveHeader.fields.BlockAlign;
+	} else {
+		// Encoded data ends at last whole block (follow size fields)
+		CODEC_HEADER block;
+		uint32_t limit = (end << 9) - 44;
+		
+		sampleCount = 0;
+		while (!f_lseek(&file, 44 + sampleCount) && !f_read(&file, &block, CODEC_HEADER_SIZE, &br) && (br == CODEC_HEADER_SIZE)
+			&& (block.size >= CODEC_HEADER_SIZE) && (block.size <= CODEC_HEADER_SIZE + CODEC_BLOCK_SAMPLES - 1)
+			&& ((block.k <= CODEC_K_MAX) || ((block.k == CODEC_RAW) && (block.size == CODEC_HEADER_SIZE + CODEC_BLOCK_SAMPLES - 1)))
+			&& ((sampleCount + block.size) <= limit)) {
+			sampleCount += block.size;
+			waveState.rec.encodedSamples += CODEC_BLOCK_SAMPLES;
+		}
+	}
+	
+	printf_P(PSTR("Recovered interrupted take (%s): %lu bytes\n"), name, sampleCount);
+	
+	// Finalise as a newly recorded take (segments beyond it are emptied)
+	f_lseek(&file, 44 + sampleCount);
+	waveState.rec.seek.interval = WAVE_SEEK_SAMPLES;
+	waveState.rec.seekCount = 0;
+	waveState.rec.markerCount = 0;
+	waveComment = "Recovered";	// Take finalised after power loss
+	segment = number;
+	finaliseHeader = 1;
+	wave_close();
+	
+	return 0;
+}
+
+/**
+ * Function: sum_suspend
+ * 
+ * Utility function. Closes the checksum sidecar, so its file structure
+ * (auxFile) can hold a segment of the take (see wave_rollover). Records
+ * staged meanwhile are written once the sidecar is reopened (sum_flush).
+ */
+void sum_suspend() {
+	FRESULT result;
+	
+	if (!sumHeld) return;
+	sumHeld = 0;
+	
+	result = f_close(&auxFile);
+	if (result) printf_P(PSTR("f_close returned error code: %d\n"), result);
+}
+
+/**
+ * Function: sum_resume
+ * 
+ * Utility function. Reopens the checksum sidecar of the take being recorded
+ * (closed by sum_suspend) after its last record. A previous segment
+ * awaiting finalisation is finalised first, releasing auxFile.
+ */
+void sum_resume() {
+	FRESULT result;
+	
+	if (!sumOpen || sumHeld) return;
+	
+	segment_finalise();
+	
+	result = f_open(&auxFile, WAVE_SUM_FILENAME, FA_OPEN_EXISTING | FA_WRITE);
+	if (!result) result = f_lseek(&auxFile, sumSize);
+	if (result) {
+		printf_P(PSTR("f_open returned error code: %d\n"), result);
+		f_close(&auxFile);
+		sumOpen = 0;	// No further checksums for this take
+		return;
+	}
+	
+	sumHeld = 1;
+}
+
+/**
+ * Function: sum_flush
+ * 
+ * Utility function. Writes staged records to the checksum sidecar
+ * (reopening it where suspended).
+ */
+void sum_flush() {
 	FRESULT result;
 	uint16_t bw;
 	
-	result = f_write(&file, pSamples, count, &bw); // Write samples to file
+	if (!sumStaged) return;
+	
+	sum_resume();
+	if (sumHeld) {
+		result = f_write(&auxFile, sumStage, sumStaged * sizeof(WAVE_SUM_RECORD), &bw);
+		if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+		sumSize += bw;
+	}
+	sumStaged = 0;
+}
 
-	// If error occurs, write status to console
-	if (result) printf("f_write returned error code: %d\n", result);
-	if (bw != count) printf("f_write wrote %d of %d bytes to file.", bw, count);
+/**
+ * Function: sum_update
+ * 
+ * Utility function. Adds audio data written to the take to the running
+ * checksum of the current page (staged by wave_page). The sums are formed
+ * as the data is written (no further pass over the data): s1 is the sum
+ * of the bytes, s2 the sum of s1 after each byte, both modulo 65536
+ * (Fletcher checksum).
+ */
+void sum_update(const uint8_t* pData, uint16_t count) {
+	uint16_t s1 = sumS1;
+	uint16_t s2 = sumS2;
+	
+	while (count--) {
+		s1 += *pData++;
+		s2 += s1;
+	}
+	
+	sumS1 = s1;
+	sumS2 = s2;
+}
 
-	// Increment sample count by number of samples written to file
-	sampleCount += bw;
+/**
+ * Function: sum_open
+ * 
+ * Utility function. Opens the checksum sidecar for a new take and writes
+ * its header. As with the take file, the sidecar of the previous take is
+ * overwritten in place (created if none exists), so its cluster chain is
+ * not freed while recording starts; records of the previous take beyond
+ * the new take are cut when it is closed (sum_close).
+ */
+void sum_open() {
+	FRESULT result;
+	uint16_t bw;
+	WAVE_SUM_HEADER header = { {'S', 'U', 'M', '2'}, WAVE_SUM_UNIT, WAVE_SUM_OVERVIEW };
+	
+	sumS1 = 0;
+	sumS2 = 0;
+	sumStaged = 0;
+	
+	result = f_open(&auxFile, WAVE_SUM_FILENAME, FA_OPEN_ALWAYS | FA_WRITE);
+	if (!result) result = f_write(&auxFile, &header, sizeof(header), &bw);
+	if (result) {
+		printf_P(PSTR("f_open returned error code: %d\n"), result);
+		f_close(&auxFile);
+		return;
+	}
+	
+	sumSize = sizeof(header);
+	sumOpen = 1;
+	sumHeld = 1;
 }
 
 /**
- * Function: wave_read
+ * Function: sum_close
  * 
- * Reads a number of audio samples from an open WAVE file.
- * This function expects 8-bit audio samples.
- *
- * Parameters:
- *    pSamples - Pointer to array of 8-bit audio samples into which samples will be read.
- *    count - Number of samples to read into array from WAVE file.
+ * Utility function. Writes any staged records, cuts records left by a
+ * longer previous take (clusters freed in the background, see
+ * wave_reclaim) and closes the checksum sidecar.
+ */
+void sum_close() {
+	FRESULT result;
+	
+	if (!sumOpen) return;
+	
+	sum_resume();
+	sum_flush();
+	sumOpen = 0;
+	
+	if (!sumHeld) return;
+	sumHeld = 0;
+	
+	result = f_cut(&auxFile);		// File pointer follows last record
+	if (result) printf_P(PSTR("f_cut returned error code: %d\n"), result);
+	result = f_close(&auxFile);
+	if (result) printf_P(PSTR("f_close returned error code: %d\n"), result);
+}
+
+/**
+ * Function: write_cues
+ * 
+ * Writes the markers of a newly created WAVE file as a cue chunk, followed
+ * by a LIST/adtl chunk labelling each cue point ("M01", "M02" ...).
  */
-void wave_read(uint8_t* pSamples, uint16_t count) {
+void write_cues() {
 	FRESULT result;
+	uint16_t bw;
+	uint32_t size = 4 + waveState.rec.markerCount * (uint32_t)sizeof(WAVE_CUE);
+	WAVE_CUE cue;
+	struct {
+		char		ID[4];		// Contains "labl" in ASCII
+		uint32_t	size;		// Size of label body (8)
+		uint32_t	id;			// Cue point identifier
+		char		text[4];	// Null terminated label
+	} label;
+	
+	// Cue points
+	result = write_id(PSTR("cue "));
+	if (!result) result = f_write(&file, &size, 4, &bw);
+	size = waveState.rec.markerCount;
+	if (!result) result = f_write(&file, &size, 4, &bw);
+	
+	set_char_array(cue.chunkID, PSTR("data"));
+	cue.chunkStart = 0;
+	cue.blockStart = 0;
+	for (uint8_t i = 0; (i < waveState.rec.markerCount) && !result; i++) {
+		cue.id = i + 1;
+		cue.position = waveState.rec.markers[i];
+		cue.sampleOffset = waveState.rec.markers[i];
+		result = f_write(&file, &cue, sizeof(cue), &bw);
+	}
+	trailerSize += 8 + 4 + waveState.rec.markerCount * (uint32_t)sizeof(WAVE_CUE);
+	
+	// Labels
+	size = 4 + waveState.rec.markerCount * (uint32_t)sizeof(label);
+	if (!result) result = write_id(PSTR("LIST"));
+	if (!result) result = f_write(&file, &size, 4, &bw);
+	if (!result) result = write_id(PSTR("adtl"));
+	
+	set_char_array(label.ID, PSTR("labl"));
+	label.size = 8;
+	for (uint8_t i = 0; (i < waveState.rec.markerCount) && !result; i++) {
+		label.id = i + 1;
+		snprintf_P(label.text, sizeof(label.text), PSTR("M%02u"), i + 1);
+		result = f_write(&file, &label, sizeof(label), &bw);
+	}
+	trailerSize += 8 + size;
+	
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+	waveState.rec.markerCount = 0;
+}
+
+/**
+ * Function: find_chunk
+ * 
+ * Searches the chunks following the data chunk of an open WAVE file for a
+ * chunk with the given identifier. On success the file pointer is left at
+ * the start of the chunk body.
+ * 
+ * Parameters:
+ *   fp - Pointer to open WAVE file.
+ *   pHeader - Pointer to header of file.
+ *   id - Chunk identifier (four characters, in program memory, see PSTR).
+ *   pSize - Receives the size of the chunk body in bytes.
+ *
+ * Returns: 1 if the chunk is found, otherwise 0.
+ */
+uint8_t find_chunk(FIL* fp, WAVE_HEADER* pHeader, const char* id, uint32_t* pSize) {
+	uint32_t pos = 44 + pHeader->fields.dataSize;
+	uint32_t end = pHeader->fields.ChunkSize + 8;
+	uint8_t chunk[8];
 	uint16_t br;
 	
-	result = f_read(&file, pSamples, count, &br); // Read samples from file
+	pos += pos & 1;		// Chunks are word aligned
+	
+	while (pos + 8 <= end) {
+		if (f_lseek(fp, pos) || f_read(fp, chunk, 8, &br) || (br != 8)) return 0;
+		
+		*pSize = *(uint32_t*)(chunk + 4);
+		if (!memcmp_P(chunk, id, 4)) return 1;
+		
+		pos += 8 + *pSize + (*pSize & 1);
+	}
+	
+	return 0;
+}
 
-	// If error occurs, write status to console
-	if (result) printf("f_write returned error code: %d\n", result);
-	if (br != count) printf("f_write wrote %d of %d bytes to file.", br, count);
-}
\ No newline at end of file
+/**
+ * Function: playable
+ * 
+ * Utility function. Checks a WAVE header matches the format recorded by
+ * this device (RIFF/WAVE, data chunk at offset 36, 8-bit mono, PCM or
+ * WAVE_FORMAT_DRICE encoded).
+ *
+ * Returns: 1 if the file can be played, otherwise 0.
+ */
+uint8_t playable(WAVE_HEADER* pHeader) {
+	return !memcmp_P(pHeader->fields.ChunkID, PSTR("RIFF"), 4)
+		&& !memcmp_P(pHeader->fields.Format, PSTR("WAVE"), 4)
+		&& !memcmp_P(pHeader->fields.dataID, PSTR("data"), 4)
+		&& ((pHeader->fields.AudioFormat == WAVE_FORMAT_PCM) || (pHeader->fields.AudioFormat == WAVE_FORMAT_DRICE))
+		&& (pHeader->fields.BlockAlign == 1)
+		&& pHeader->fields.dataSize;
+}
+
+/**
+ * Function: read_standby
+ * 
+ * Utility function. Reads the header of a file opened as the standby file
+ * of the playlist (auxFile), keeping the fields needed to join it.
+ *
+ * Returns: 1 if the file can be played, otherwise 0.
+ */
+uint8_t read_standby() {
+	WAVE_HEADER header;
+	
+	if (!read_wave_header(&auxFile, &header) || !playable(&header)) return 0;
+	
+	waveState.play.nextData = header.fields.dataSize;
+	waveState.play.nextFormat = header.fields.AudioFormat;
+	
+	return 1;
+}
+
+/**
+ * Function: switch_file
+ * 
+ * Utility function. Closes the current file and makes the standby (next)
+ * file of the playlist current. The header of the new file is read again
+ * (from the sector holding the start of its data, read next in any case),
+ * so no copy of it is held while the file is in standby.
+ */
+void switch_file() {
+	f_close(&file);
+	
+	file = auxFile;
+	nextQueued = 0;
+	f_lseek(&file, 0);
+	read_wave_header(&file, &waveHeader);	// Leaves file at start of data
+	dataRemaining = waveState.play.nextData;
+	waveState.play.seekLoaded = 0;
+}
+
+/************************************************************************/
+/* PUBLIC/USER FUNCTIONS                                                */
+/************************************************************************/
+
+/**
+ * Function: wave_init
+ * 
+ * Initialises the WAVE module for use. Starts initialisation of the SD card
+ * and registers the filesystem (mounted by wave_poll once the card is ready).
+ * wave_poll must report WAVE_CARD_READY prior to calling any other function
+ * in the WAVE module.
+ */
+void wave_init() {
+	FRESULT result;
+	
+	waveCard = WAVE_CARD_BUSY;
+	disk_start(0);		// Reset card, card leaves idle state while polled
+	
+	result = f_mount(&fs, "/", 0);	// register SD card root directory (delayed mount)
+
+	// If error occurs, write status to console
+	if (result) printf_P(PSTR("f_mount returned error code: %d\n"), result);
+}
+
+/**
+ * Function: wave_poll
+ * 
+ * Continues initialisation of the SD card (without blocking), mounting the
+ * filesystem once the card is ready. FSINFO (free cluster count and last
+ * allocated cluster) is trusted, so no FAT scan is required.
+ *
+ * Returns: State of SD card (WAVE_CARD_BUSY, WAVE_CARD_READY or WAVE_CARD_FAILED).
+ */
+uint8_t wave_poll() {
+	FRESULT result;
+	
+	if ((waveCard != WAVE_CARD_BUSY) || disk_poll(0)) return waveCard;
+	
+	if (disk_status(0) & STA_NOINIT) {
+		waveCard = WAVE_CARD_FAILED;
+	} else {
+		result = f_mount(&fs, "/", 1);	// force mount SD card root directory
+		
+		// If error occurs, write status to console
+		if (result) printf_P(PSTR("f_mount returned error code: %d\n"), result);
+		
+		waveCard = result ? WAVE_CARD_FAILED : WAVE_CARD_READY;
+		
+		// Finalise take (or segment) interrupted by power loss
+		if (!result) {
+			erase_stop();	// Recovery opens the take file (file structure of pre-erase)
+			for (uint8_t n = 0; (n <= WAVE_SEGMENTS_MAX) && recover_take(n); n++);
+		}
+	}
+	
+	return waveCard;
+}
+
+/**
+ * Function: wave_create
+ * 
+ * Creates a and initialises a WAVE file for read/write access.
+ * The WAVE filename is hardcoded to "EGB240.WAV"
+ * If a file with the same name exists it is overwritten and cleared.
+ * The created WAVE file is initialised with an empty header.
+ *
+ * Postcondition:
+ *    Creating a wave file resets the sample counter.
+ */
+void wave_create() {
+	FRESULT result;
+	
+	erase_stop();	// Abandon pre-erase (same file)
+	verify_stop();	// Abandon verify (checksum sidecar is replaced)
+	
+	// Open existing WAVE file and overwrite in place (create if none exists).
+	// Unlike FA_CREATE_ALWAYS, the cluster chain of the previous take is not
+	// freed before recording; clusters beyond the new take are kept as a
+	// preallocated slot (see wave_reuse). Where reuse is disabled the file is
+	// truncated here, before recording starts.
+	result = f_open(&file, "EGB240.WAV", (waveReuse ? FA_OPEN_ALWAYS : FA_CREATE_ALWAYS) | FA_READ | FA_WRITE);
+
+	// If error occurs, write status to console
+	if (result) printf_P(PSTR("f_open returned error code: %d\n"), result);
+	
+	// Write WAVE file header to file
+	write_wave_header();
+	sum_open();		// Checksums of audio data are written alongside
+	
+	// Reset sample counter
+	sampleCount = 0;
+	waveState.rec.encodedSamples = 0;
+	waveState.rec.seek.interval = WAVE_SEEK_SAMPLES;
+	waveState.rec.seekCount = 0;
+	waveState.rec.markerCount = 0;
+}
+
+/**
+ * Function: wave_open
+ * 
+ * Opens an existing WAVE file for read only access.
+ * The WAVE filename is hardcoded to "EGB240.WAV"
+ * For encoded (non-PCM) files the number of samples is read from the fact
+ * chunk; wave_read then returns the encoded data (see wave_audioFormat).
+ *
+ * Returns: The number of samples in the opened WAVE file.
+ */
+uint32_t wave_open() {
+	FRESULT result;
+	
+	verify_stop();	// Abandon verify (file, auxFile)
+	erase_suspend();	// Take file not open for write during playback (pre-erase resumes when stopped)
+	
+	// Open an existing WAVE file with read only access
+	result = f_open(&file, "EGB240.WAV", FA_READ);
+
+	// If error occurs, write status to console
+	if (result) printf_P(PSTR("f_open returned error code: %d\n"), result);
+	
+	// Map the cluster chain so seeks (markers, seek table) require no FAT access
+	// Where the file is too fragmented for the map, seek by following the chain
+	file.cltbl = waveState.play.clmt;
+	waveState.play.clmt[0] = WAVE_CLMT_SIZE;
+	if (f_lseek(&file, CREATE_LINKMAP)) file.cltbl = 0;
+	
+	// Read the WAVE file header and return the number of samples reported
+	dataRemaining = read_wave_header(&file, &waveHeader);
+	waveState.play.seekLoaded = 0;		// Seek table located on first seek
+	
+	if (dataRemaining && (waveHeader.fields.AudioFormat != WAVE_FORMAT_PCM)) {
+		uint32_t size;
+		uint32_t samples = 0;
+		uint16_t br;
+		
+		// Sample count of encoded data is held in fact chunk
+		if (find_chunk(&file, &waveHeader, PSTR("fact"), &size)) f_read(&file, &samples, 4, &br);
+		f_lseek(&file, 44);		// Return to start of data
+		
+		return samples;
+	}
+	
+	return dataRemaining;
+}
+
+/**
+ * Function: wave_audioFormat
+ * 
+ * Returns: The audio format of the open WAVE file (WAVE_FORMAT_*).
+ */
+uint16_t wave_audioFormat() {
+	return waveHeader.fields.AudioFormat;
+}
+
+/**
+ * Function: wave_numChannels
+ * 
+ * Returns: The number of channels of the open WAVE file (samples per frame, at least 1).
+ */
+uint8_t wave_numChannels() {
+	return waveHeader.fields.NumChannels ? waveHeader.fields.NumChannels : 1;
+}
+
+/**
+ * Function: wave_format
+ * 
+ * Selects the audio format of WAVE files subsequently created with wave_create.
+ * For formats other than WAVE_FORMAT_PCM the data written with wave_write is
+ * encoded, and the number of samples it represents must be reported with
+ * wave_encoded.
+ *
+ * Parameters:
+ *    format - Audio format (WAVE_FORMAT_*)
+ */
+void wave_format(uint16_t format) {
+	waveFormat = format;
+}
+
+/**
+ * Function: wave_channels
+ * 
+ * Selects the number of channels of WAVE files subsequently created with
+ * wave_create. Data written with wave_write must be interleaved frames
+ * (one sample of each channel in turn). Only PCM is supported with more than
+ * one channel. The last take is still played by this device, its frames in
+ * turn at the conversion rate (a mono mix), but playlists skip such files
+ * (see playable).
+ *
+ * Parameters:
+ *    channels - Number of channels (1 = mono, 2 = stereo)
+ */
+void wave_channels(uint8_t channels) {
+	waveChannels = channels ? channels : 1;
+}
+
+/**
+ * Function: wave_encoded
+ * 
+ * Reports the number of samples represented by encoded data written to a
+ * WAVE file (non-PCM formats). Recorded in the fact chunk on finalisation.
+ * Call once per block, after the block is written: where the next block
+ * starts on an interval of the seek table its offset is added to the table.
+ * When the table is full every second entry is discarded and the interval
+ * doubled, so the table covers a take of any length in fixed memory.
+ *
+ * Parameters:
+ *    samples - Number of samples encoded by data written since last call.
+ */
+void wave_encoded(uint16_t samples) {
+	waveState.rec.encodedSamples += samples;
+	
+	if (waveState.rec.encodedSamples % waveState.rec.seek.interval) return;
+	
+	if (waveState.rec.seekCount == WAVE_SEEK_ENTRIES) {
+		for (uint8_t i = 0; i < WAVE_SEEK_ENTRIES/2; i++) {
+			waveState.rec.seek.offsets[i] = waveState.rec.seek.offsets[2*i + 1];
+		}
+		waveState.rec.seekCount = WAVE_SEEK_ENTRIES/2;
+		waveState.rec.seek.interval <<= 1;
+		if (waveState.rec.encodedSamples % waveState.rec.seek.interval) return;
+	}
+	
+	waveState.rec.seek.offsets[waveState.rec.seekCount++] = sampleCount;	// Data written so far (start of next block)
+}
+
+/**
+ * Function: wave_close
+ * 
+ * Closes an open WAVE file. If required, the WAVE file header is finalised prior to closing.
+ */
+void wave_close() {
+	FRESULT result;
+	
+	if (finaliseHeader) {
+		// Only finalise header where WAVE file is newly created 
+		uint8_t junk;
+		
+		finaliseHeader = 0;
+		junk = finish_data();
+		finalise_wave_header(&file, sampleCount, trailerSize);
+		
+		// Close WAVE file
+		result = f_close(&file);
+		
+		// Pre-erase unused part of reused take file
+		if (!result && junk) erase_start(junkData);
+		
+		sum_close();	// Records of final pages of take (releases auxFile)
+		segment_end();	// Finalise previous segment, discard unused segment files
+	} else {
+		// Close WAVE file
+		result = f_close(&file);
+	}
+
+	// If error occurs, write status to console
+	if (result) printf_P(PSTR("f_close returned error code: %d\n"), result);
+	
+	// Close standby file and directory of playlist
+	if (nextQueued) f_close(&auxFile);
+	if (listActive) f_closedir(&waveState.play.listDir);
+	nextQueued = 0;
+	listActive = 0;
+}
+
+/**
+ * Function: wave_openList
+ * 
+ * Starts playlist playback. Opens the first playable WAVE file in the
+ * root directory for read only access. Subsequent files are opened with
+ * wave_prefetch and joined seamlessly by wave_read.
+ *
+ * Returns: The size of the audio data of the first file (0 if none found).
+ */
+uint32_t wave_openList() {
+	FRESULT result;
+	
+	verify_stop();	// Abandon verify (file, auxFile)
+	erase_suspend();	// Take file not open for write during playback (pre-erase resumes when stopped)
+	nextQueued = 0;
+	listActive = 0;
+	dataRemaining = 0;
+	
+	result = f_opendir(&waveState.play.listDir, "/");
+	if (result) {
+		printf_P(PSTR("f_opendir returned error code: %d\n"), result);
+		return 0;
+	}
+	listActive = 1;
+	
+	// Open first file as standby, then make it current
+	if (!wave_prefetch()) {
+		f_closedir(&waveState.play.listDir);
+		listActive = 0;
+		return 0;
+	}
+	switch_file();
+	
+	return dataRemaining;
+}
+
+/**
+ * Function: wave_prefetch
+ * 
+ * Opens the next playable WAVE file of the playlist as the standby file
+ * and parses its header, so that it can be joined without delay when the
+ * current file is exhausted. Call from the main loop (not time critical).
+ *
+ * Returns: 1 if a file is queued (or already queued), 0 at end of playlist.
+ */
+uint8_t wave_prefetch() {
+	FILINFO info;
+	char* ext;
+	
+	if (nextQueued) return 1;
+	if (!listActive) return 0;
+	
+	for (;;) {
+		if (f_readdir(&waveState.play.listDir, &info) || !info.fname[0]) return 0;	// End of directory
+		if (info.fattrib & (AM_DIR | AM_HID | AM_SYS)) continue;
+		
+		ext = strchr(info.fname, '.');
+		if (!ext || strcmp(ext, ".WAV")) continue;
+		
+		if (f_open(&auxFile, info.fname, FA_READ)) continue;
+		if (read_standby()) break;
+		f_close(&auxFile);
+	}
+	
+	nextQueued = 1;
+	
+	return 1;
+}
+
+/**
+ * Function: wave_needPrefetch
+ * 
+ * Returns: True where a playlist is active, no standby file is open and
+ *          less than WAVE_PREFETCH_BYTES of data remain in the current file.
+ */
+uint8_t wave_needPrefetch() {
+	return listActive && !nextQueued && (dataRemaining < WAVE_PREFETCH_BYTES);
+}
+
+/**
+ * Function: wave_listContinue
+ * 
+ * Checks whether playlist playback continues once the data of the current
+ * file is exhausted. Where the next file has not yet been opened (prefetch
+ * late), it is opened now.
+ *
+ * Returns: 1 where a further file is queued, 0 at end of playlist (or where
+ *          data of the current file remains, or no playlist is active).
+ */
+uint8_t wave_listContinue() {
+	return listActive && !dataRemaining && wave_prefetch();
+}
+
+/**
+ * Function: wave_advance
+ * 
+ * Makes the standby file current where the data of the current file is
+ * exhausted. Used before reading a new block of encoded data, whose
+ * format may differ from that of the previous file.
+ */
+void wave_advance() {
+	if (!dataRemaining && nextQueued) switch_file();
+}
+
+/**
+ * Function: wave_repeat
+ * 
+ * Enables or disables repeat mode. In repeat mode, reading continues from
+ * the start of the data chunk of the open file once its data is exhausted,
+ * without closing or reopening the file (not applied to playlists).
+ *
+ * Parameters:
+ *    enable - Non-zero to enable repeat mode.
+ */
+void wave_repeat(uint8_t enable) {
+	waveRepeat = enable;
+}
+
+/**
+ * Function: wave_reuse
+ * 
+ * Selects how the take file is left when closed. Where enabled, the file
+ * is kept at WAVE_SLOT_BYTES (the remainder covered by a JUNK chunk), so
+ * the next take is recorded without FAT updates. Where disabled, the file
+ * is truncated when the next take is created (FA_CREATE_ALWAYS), freeing
+ * its cluster chain before sampling starts (compare the record start
+ * latency of the two modes).
+ *
+ * Parameters:
+ *    enable - Non-zero to reuse the take file.
+ */
+void wave_reuse(uint8_t enable) {
+	waveReuse = enable;
+}
+
+/**
+ * Function: wave_preErase
+ * 
+ * Enables/disables pre-erase of the take file while idle (see wave_erase).
+ * Where disabled, takes are written over the blocks of the previous take,
+ * which the card must erase as they are written (compare the card write
+ * busy statistics of takes recorded in the two modes).
+ *
+ * Parameters:
+ *    enable - Non-zero to pre-erase the take file.
+ */
+void wave_preErase(uint8_t enable) {
+	waveErase = enable;
+	if (!enable) erase_stop();
+}
+
+/**
+ * Function: wave_prepare
+ * 
+ * Discards the last take and prepares the take file for the next take. An
+ * empty WAVE header is written (the file kept at WAVE_SLOT_BYTES), then the
+ * remainder of the file is pre-erased in the background (see wave_erase).
+ */
+void wave_prepare() {
+	FRESULT result;
+	
+	wave_create();			// Open take file, write header
+	sum_close();			// No audio data
+	finaliseHeader = 0;
+	trailerSize = 0;
+	write_junk();			// Preallocate, cover remainder of file
+	finalise_wave_header(&file, 0, trailerSize);	// No samples
+	
+	result = f_close(&file);
+	if (result) printf_P(PSTR("f_close returned error code: %d\n"), result);
+	
+	erase_start(junkData);
+}
+
+/**
+ * Function: wave_erase
+ * 
+ * Pre-erases a batch of clusters of the take file (started by wave_close
+ * or wave_prepare). Called from idle time while stopped. A batch is not
+ * started while the card is still erasing the previous one, so no call
+ * waits for the card. Segments left by a longer take are emptied first,
+ * one per call (segment_clear).
+ *
+ * Returns: Non-zero where clusters remain to be erased (or segments emptied).
+ */
+uint8_t wave_erase() {
+	FRESULT result;
+	uint8_t ready;
+	
+	if (verifyActive) return eraseActive || segClear;	// WAVE file structure is used by verify (resumes when complete)
+	
+	if (segClear) {
+		segment_clear();
+		return 1;
+	}
+	
+	if (!eraseActive) return 0;
+	
+	if (!eraseOpen) {
+		result = f_open(&file, "EGB240.WAV", FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+		if (result) {
+			printf_P(PSTR("f_open returned error code: %d\n"), result);
+			eraseActive = 0;
+			return 0;
+		}
+		eraseOpen = 1;
+	}
+	
+	// Previous batch is erased by the card in the background, do not wait for it
+	if (disk_ioctl(0, MMC_GET_READY, &ready) || !ready) return 1;
+	
+	result = f_erase(&file, eraseOffset, WAVE_ERASE_BATCH, &eraseOffset, &eraseCluster);
+	if (result) printf_P(PSTR("f_erase returned error code: %d\n"), result);
+	
+	if (result || (eraseOffset >= f_size(&file))) erase_stop();
+	
+	return eraseActive;
+}
+
+/**
+ * Function: wave_mkfs
+ * 
+ * Quick formats the SD card with a volume laid out for recording (all files
+ * are erased). The partition and the data area start on an allocation unit
+ * (erase block) boundary of the card, and the largest cluster size up to
+ * 32 KB that divides the allocation unit and leaves enough clusters for
+ * FAT32 is used, so clusters never straddle an erase block.
+ *
+ * Returns: Non-zero where successful.
+ */
+uint8_t wave_mkfs() {
+	FRESULT result;
+	DWORD sectors, block;
+	UINT au = 64;		// Cluster size (sectors)
+	
+	if (disk_ioctl(0, GET_SECTOR_COUNT, &sectors) || disk_ioctl(0, GET_BLOCK_SIZE, &block)) {
+		printf_P(PSTR("disk_ioctl returned error\n"));
+		return 0;
+	}
+	
+	erase_stop();	// Take file is erased by format
+	verify_stop();
+	
+	while ((au > 1) && ((au > block) || ((sectors / au) < WAVE_FAT32_CLUSTERS))) au >>= 1;
+	printf_P(PSTR("Formatting: %lu sectors, allocation unit %lu sectors, cluster %u sectors\n"), sectors, block, au);
+	
+	result = f_mkfs("", 0, au * 512);	// Partitioned (FDISK), au in bytes
+	if (result) printf_P(PSTR("f_mkfs returned error code: %d\n"), result);
+	
+	if (!result) {
+		result = f_mount(&fs, "/", 1);	// force mount new volume
+		if (result) printf_P(PSTR("f_mount returned error code: %d\n"), result);
+	}
+	waveCard = result ? WAVE_CARD_FAILED : WAVE_CARD_READY;
+	
+	return !result;
+}
+
+/**
+ * Function: wave_layout
+ * 
+ * Prints the layout of the mounted volume (cluster size and start of the
+ * data area against the allocation unit of the card), identifying the
+ * format that throughput figures (page write statistics) were taken on,
+ * e.g. the factory format against that of wave_mkfs.
+ */
+void wave_layout() {
+	DWORD block;
+	
+	if (disk_ioctl(0, GET_BLOCK_SIZE, &block) || !block) block = 1;
+	
+	printf_P(PSTR("Card layout: cluster %u sectors, data area at sector %lu, allocation unit %lu sectors (aligned %u)\n"),
+		fs.csize, fs.database, block, !(fs.database % block));
+}
+
+/**
+ * Function: wave_reclaim
+ * 
+ * Frees a batch of clusters released when a file was cut (take file, see
+ * wave_reuse, checksum sidecar and emptied segments). Cut chains are
+ * queued by f_cut and freed in order. Called from idle time; the FAT is
+ * consistent between batches, so files may be created or written while
+ * clusters remain.
+ *
+ * Returns: Non-zero where clusters remain to be freed.
+ */
+uint8_t wave_reclaim() {
+	FRESULT result;
+	
+	if (!fs.reclaim[0]) return 0;
+	
+	// A chain failing removal is abandoned by f_reclaim (clusters are lost, not cross-linked)
+	result = f_reclaim(&fs, WAVE_RECLAIM_BATCH);
+	if (result) printf_P(PSTR("f_reclaim returned error code: %d\n"), result);
+	
+	return fs.reclaim[0] != 0;
+}
+
+/**
+ * Function: wave_comment
+ * 
+ * Supplies a comment to be stored in a LIST/INFO (ICMT) chunk after the
+ * audio data when a newly created WAVE file is closed. The string is not
+ * copied and must remain valid until wave_close is called.
+ *
+ * Parameters:
+ *    text - Null terminated comment string.
+ */
+void wave_comment(const char* text) {
+	waveComment = text;
+}
+
+/**
+ * Function: wave_write
+ * 
+ * Writes a number of audio samples into a open WAVE file.
+ * This function expects 8-bit audio samples.
+ *
+ * Parameters:
+ *    pSamples - Pointer to array of 8-bit audio samples to write to WAVE file.
+ *    count - Number of samples to write from array into WAVE file.
+ */
+void wave_write(uint8_t* pSamples, uint16_t count) {
+	FRESULT result;
+	uint16_t bw;
+	
+	result = f_write(&file, pSamples, count, &bw); // Write samples to file
+
+	// If error occurs, write status to console
+	if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+	if (bw != count) printf_P(PSTR("f_write wrote %d of %d bytes to file."), bw, count);
+
+	// Checksum of data as written (see wave_verify)
+	if (sumOpen) sum_update(pSamples, bw);
+	
+	// Increment sample count by number of samples written to file
+	sampleCount += bw;
+}
+
+/**
+ * Function: wave_page
+ * 
+ * Ends the audio data written for a buffer page (a page of PCM data, or
+ * one encoded block). The checksum of the data is staged for the sidecar
+ * along with the overview of the page, and written once WAVE_SUM_STAGE
+ * bytes are staged.
+ *
+ * Parameters:
+ *    pPairs - Pointer to overview min/max pairs of the page (WAVE_SUM_PAIRS).
+ */
+void wave_page(const uint8_t* pPairs) {
+	WAVE_SUM_RECORD* pRecord;
+	
+	if (!sumOpen) return;
+	
+	pRecord = &sumStage[sumStaged++];
+	pRecord->s1 = sumS1;
+	pRecord->s2 = sumS2;
+	memcpy(pRecord->pairs, pPairs, sizeof(pRecord->pairs));
+	
+	sumS1 = 0;
+	sumS2 = 0;
+	
+	if (sumStaged == (sizeof(sumStage) / sizeof(WAVE_SUM_RECORD))) sum_flush();
+}
+
+/**
+ * Function: wave_read
+ * 
+ * Reads a number of audio samples from an open WAVE file.
+ * This function expects 8-bit audio samples. Reads do not extend beyond
+ * the data chunk; samples requested beyond the end of the audio data are
+ * filled with silence (0x80). During playlist playback, where the current
+ * file is exhausted and the next file is uncompressed, reading continues
+ * from the next file.
+ *
+ * Parameters:
+ *    pSamples - Pointer to array of 8-bit audio samples into which samples will be read.
+ *    count - Number of samples to read into array from WAVE file.
+ *
+ * Returns: The number of samples read (less than count at end of data).
+ */
+uint16_t wave_read(uint8_t* pSamples, uint16_t count) {
+	FRESULT result;
+	uint16_t br;
+	uint16_t btr;
+	uint16_t total = 0;
+	
+	do {
+		// Continue from next file of playlist (if format allows)
+		if (!dataRemaining && nextQueued && (waveHeader.fields.AudioFormat == waveState.play.nextFormat)
+			&& (waveState.play.nextFormat == WAVE_FORMAT_PCM)) {
+			switch_file();
+		}
+		
+		// Return to start of data chunk (repeat mode). Seeking back within the
+		// first cluster restarts from the start cluster cached in the file
+		// structure, so no FAT or header access is required.
+		if (!dataRemaining && waveRepeat && !listActive) {
+			f_lseek(&file, 44);
+			dataRemaining = waveHeader.fields.dataSize;
+		}
+		
+		// Do not read beyond the data chunk (e.g. into trailing chunks)
+		btr = count - total;
+		if (btr > dataRemaining) btr = dataRemaining;
+		if (!btr) break;
+		
+		result = f_read(&file, pSamples + total, btr, &br); // Read samples from file
+
+		// If error occurs, write status to console
+		if (result) printf_P(PSTR("f_write returned error code: %d\n"), result);
+		if (br != btr) printf_P(PSTR("f_write wrote %d of %d bytes to file."), br, btr);
+		
+		dataRemaining -= br;
+		total += br;
+	} while (br && (total < count));
+	
+	// Pad with silence
+	if (total < count) memset(pSamples + total, 0x80, count - total);
+	
+	return total;
+}
+
+/**
+ * Function: wave_seek
+ * 
+ * Positions an open WAVE file (wave_open) so that wave_read continues from the
+ * given sample (frame, where the file has more than one channel, as for
+ * markers). PCM data is positioned exactly. For encoded formats the file
+ * is positioned at the last seek table entry at or before the sample: the seek
+ * table is located on the first seek after the file is opened, after which
+ * each seek reads a single entry. Where a file has no seek table the block
+ * size fields are followed from the start of data.
+ *
+ * Parameters:
+ *    sample - Sample to continue playback from.
+ *
+ * Returns: The sample actually reached (playback continues from this sample).
+ */
+uint32_t wave_seek(uint32_t sample) {
+	uint32_t offset = 0;
+	uint32_t size;
+	uint16_t br;
+	
+	if (waveHeader.fields.AudioFormat == WAVE_FORMAT_PCM) {
+		uint16_t align = waveHeader.fields.BlockAlign ? waveHeader.fields.BlockAlign : 1;
+		
+		// Whole frames (one sample of each channel)
+		if (sample > waveHeader.fields.dataSize / align) sample = waveHeader.fields.dataSize / align;
+		offset = sample * align;
+	} else {
+		// Locate seek table (once per file)
+		if (!waveState.play.seekLoaded) {
+			waveState.play.seekLoaded = 1;
+			waveState.play.seekChunk = 0;
+			if (find_chunk(&file, &waveHeader, PSTR("seek"), &size) && (size >= 4)) {
+				waveState.play.seekChunk = f_tell(&file);
+				waveState.play.seekEntries = (size - 4) >> 2;
+				f_read(&file, &waveState.play.seekInterval, 4, &br);
+			}
+		}
+		
+		if (waveState.play.seekChunk && waveState.play.seekInterval && waveState.play.seekEntries) {
+			uint32_t entry = sample / waveState.play.seekInterval;
+			
+			if (entry > waveState.play.seekEntries) entry = waveState.play.seekEntries;
+			if (entry) {
+				f_lseek(&file, waveState.play.seekChunk + 4*entry);		// Offset of entry (interval precedes entries)
+				f_read(&file, &offset, 4, &br);
+			}
+			sample = entry * waveState.play.seekInterval;
+		} else {
+			// No seek table, follow size fields of blocks from start of data
+			uint32_t block = 0;
+			uint16_t blockSize;
+			
+			while ((block + CODEC_BLOCK_SAMPLES) <= sample) {
+				if (f_lseek(&file, 44 + offset) || f_read(&file, &blockSize, 2, &br) || (br != 2)) break;
+				if (!blockSize || ((offset + blockSize) > waveHeader.fields.dataSize)) break;
+				offset += blockSize;
+				block += CODEC_BLOCK_SAMPLES;
+			}
+			sample = block;
+		}
+		
+		if (offset > waveHeader.fields.dataSize) offset = waveHeader.fields.dataSize;
+	}
+	
+	f_lseek(&file, 44 + offset);
+	dataRemaining = waveHeader.fields.dataSize - offset;
+	
+	return sample;
+}
+
+/**
+ * Function: wave_mark
+ * 
+ * Adds a marker to a newly created WAVE file. Markers are held in memory
+ * and written as a cue chunk when the file (or segment) is closed.
+ *
+ * Parameters:
+ *    sample - Sample position of marker (from start of take).
+ *
+ * Returns: The number of the marker (from 1), or zero where no more markers can be stored.
+ */
+uint8_t wave_mark(uint32_t sample) {
+	if (waveState.rec.markerCount == WAVE_MARKERS) return 0;
+	
+	// Position within current segment
+	waveState.rec.markers[waveState.rec.markerCount] = (sample > waveState.rec.segBase) ? sample - waveState.rec.segBase : 0;
+	return ++waveState.rec.markerCount;
+}
+
+/**
+ * Function: wave_cue
+ * 
+ * Reads the position of a marker (cue point) of an open WAVE file.
+ * Playback may be continued from the marker with wave_seek. Where the
+ * marker does not exist the read position of the file is unchanged.
+ *
+ * Parameters:
+ *    number - Number of marker (from 1, in order of the cue chunk).
+ *    pSample - Receives the sample position of the marker.
+ *
+ * Returns: 1 if the marker exists, otherwise 0.
+ */
+uint8_t wave_cue(uint8_t number, uint32_t* pSample) {
+	uint32_t pos = f_tell(&file);
+	uint32_t size;
+	uint32_t count;
+	uint16_t br;
+	
+	if (number && find_chunk(&file, &waveHeader, PSTR("cue "), &size) && (size >= 4)
+		&& !f_read(&file, &count, 4, &br) && (number <= count)) {
+		// Sample offset is the last field of the cue point
+		f_lseek(&file, f_tell(&file) + (number - 1) * (uint32_t)sizeof(WAVE_CUE) + 20);
+		if (!f_read(&file, pSample, 4, &br) && (br == 4)) return 1;
+	}
+	
+	f_lseek(&file, pos);
+	return 0;
+}
+
+/**
+ * Function: wave_segment
+ * 
+ * Enables/disables segmented recording. Takes are split into files of at
+ * most WAVE_SEGMENT_SAMPLES samples or WAVE_SEGMENT_BYTES bytes of data
+ * (see wave_segmentDue, wave_rollover). Takes effect from the next take.
+ *
+ * Parameters:
+ *    enable - Non-zero to record in segments.
+ */
+void wave_segment(uint8_t enable) {
+	waveSegment = enable;
+}
+
+/**
+ * Function: wave_segmentDue
+ * 
+ * Returns: Non-zero where segmented recording is enabled and the current
+ * segment is full (call between blocks/pages, before writing the next).
+ */
+uint8_t wave_segmentDue() {
+	uint32_t samples = (waveHeader.fields.AudioFormat == WAVE_FORMAT_PCM) ? sampleCount / waveHeader.fields.BlockAlign : waveState.rec.encodedSamples;
+	
+	return waveSegment && finaliseHeader && (segment < WAVE_SEGMENTS_MAX)
+		&& ((samples >= WAVE_SEGMENT_SAMPLES) || (sampleCount >= WAVE_SEGMENT_BYTES));
+}
+
+/**
+ * Function: wave_rollover
+ * 
+ * Continues recording in the next segment of the take. The next segment
+ * (created by wave_segmentIdle, else created here) is opened in auxFile,
+ * the trailing chunks of the current segment are written, then the two
+ * file structures are exchanged. Finalising the header of the previous
+ * segment is deferred to wave_segmentIdle, so the rollover costs a page
+ * write plus closing the checksum sidecar and opening the next segment
+ * (directory sectors), and no samples are lost.
+ *
+ * Returns: The number of the new segment.
+ */
+uint8_t wave_rollover() {
+	char name[13];
+	
+	segment_finalise();						// Previous rollover not yet finalised
+	if (!segNext) wave_segmentIdle();		// Next segment not yet created
+	if (!segNext) return segment;			// Continue in current segment
+	
+	// Sidecar is reopened once the previous segment is finalised (sum_flush)
+	sum_suspend();
+	segment_name(name, segment + 1);
+	if (f_open(&auxFile, name, FA_OPEN_EXISTING | FA_READ | FA_WRITE) || f_lseek(&auxFile, 44)) {
+		f_close(&auxFile);
+		segNext = 0;
+		return segment;						// Continue in current segment
+	}
+	
+	finish_data();
+	
+	// Previous segment is finalised in the background (file structures
+	// exchanged, the previous segment is held in auxFile until then)
+	waveState.rec.segData = sampleCount;
+	waveState.rec.segTrailer = trailerSize;
+	swap_files();
+	segPending = 1;
+	segNext = 0;
+	segment++;
+	
+	// Counters of new segment
+	waveState.rec.segBase += (waveHeader.fields.AudioFormat == WAVE_FORMAT_PCM) ? sampleCount / waveHeader.fields.BlockAlign : waveState.rec.encodedSamples;
+	sampleCount = 0;
+	waveState.rec.encodedSamples = 0;
+	waveState.rec.seek.interval = WAVE_SEEK_SAMPLES;
+	waveState.rec.seekCount = 0;
+	
+	return segment;
+}
+
+/**
+ * Function: wave_segmentIdle
+ * 
+ * Background work of segmented recording, called from idle time while
+ * recording: finalises the previous segment (then reopens the checksum
+ * sidecar), or creates the next segment with an empty header (one step
+ * per call). The sidecar is closed while auxFile is in use here.
+ *
+ * Returns: Non-zero where work was done.
+ */
+uint8_t wave_segmentIdle() {
+	FRESULT result;
+	uint16_t bw;
+	char name[13];
+	
+	if (segPending) {
+		sum_resume();		// Finalises the previous segment first
+		segment_finalise();	// (where no sidecar is written)
+		return 1;
+	}
+	
+	if (!waveSegment || !finaliseHeader || segNext || (segment >= WAVE_SEGMENTS_MAX)) return 0;
+	
+	// Create next segment and write empty header. An existing file is
+	// overwritten in place (its chain is not freed here); data beyond the
+	// new data is cut when the segment is finalised (finish_data)
+	sum_suspend();
+	segment_name(name, segment + 1);
+	result = f_open(&auxFile, name, FA_OPEN_ALWAYS | FA_WRITE);
+	if (!result) result = f_write(&auxFile, &(waveHeader.bytes), 44, &bw);
+	if (!result) result = f_close(&auxFile);
+	if (result) printf_P(PSTR("f_open returned error code: %d\n"), result);
+	sum_resume();
+	
+	segNext = !result;
+	return 1;
+}
+
+/**
+ * Function: verify_stop
+ * 
+ * Utility function. Ends a verify in progress, closing its files.
+ */
+void verify_stop() {
+	if (!verifyActive) return;
+	
+	verifyActive = 0;
+	f_close(&file);
+	f_close(&auxFile);
+}
+
+/**
+ * Function: verify_next
+ * 
+ * Utility function. Opens the next segment of the take being verified
+ * (file, header read into waveHeader, unused while stopped), positioned
+ * at the start of its audio data.
+ *
+ * Returns: 1 if a segment was opened, otherwise 0 (end of take).
+ */
+uint8_t verify_next() {
+	char name[13];
+	
+	if (waveState.verify.seg) f_close(&file);
+	
+	if (waveState.verify.seg > WAVE_SEGMENTS_MAX) return 0;
+	segment_name(name, waveState.verify.seg++);
+	if (f_open(&file, name, FA_READ)) return 0;
+	
+	// Any take recorded by this device (including multi-channel, not playable)
+	if (!read_wave_header(&file, &waveHeader) || memcmp_P(waveHeader.fields.dataID, PSTR("data"), 4)
+			|| !waveHeader.fields.BlockAlign || !waveHeader.fields.dataSize) {
+		f_close(&file);
+		waveState.verify.seg = WAVE_SEGMENTS_MAX + 1;	// Nothing further (closed)
+		return 0;
+	}
+	
+	waveState.verify.remaining = waveHeader.fields.dataSize;
+	waveState.verify.blocks = (waveHeader.fields.AudioFormat != WAVE_FORMAT_PCM);
+	
+	return 1;
+}
+
+/**
+ * Function: page_ms
+ * 
+ * Utility function. Returns the time of the start of a page of a take (ms,
+ * 512 conversions of 64 us per page, whatever the format or channels).
+ */
+uint32_t page_ms(uint32_t page) {
+	return (page * 4096) / 125;		// 32.768 ms per page
+}
+
+/**
+ * Function: verify_report
+ * 
+ * Utility function. Prints a damaged range of the take (ms).
+ */
+void verify_report(uint32_t end) {
+	printf_P(PSTR("Damaged: %lu - %lu ms\n"), page_ms(waveState.verify.badStart), page_ms(end));
+	waveState.verify.bad = 0;
+}
+
+/**
+ * Function: wave_verifyStart
+ * 
+ * Starts verification of the last take (all segments) against its checksum
+ * sidecar (WAVE_SUM_FILENAME). Verification continues in the background
+ * (wave_verify). The take is read through the WAVE file structure, so
+ * pre-erase is suspended meanwhile. Sidecar layout, for host tools:
+ *
+ *   "SUM2", samples per page (uint16), samples per overview pair N
+ *   (uint16), then one record per buffer page recorded: s1, s2 (uint16,
+ *   see sum_update) of the data written for the page (512 bytes of PCM
+ *   data, or one encoded block), and the min/max overview pairs of the
+ *   page (WAVE_SUM_PAIRS pairs of unsigned samples). Pages run through
+ *   the data chunks of the segments of the take in order.
+ *
+ * Returns: 1 if verification started, otherwise 0 (no sidecar).
+ */
+uint8_t wave_verifyStart() {
+	WAVE_SUM_HEADER header;
+	uint16_t br;
+	
+	verify_stop();
+	erase_suspend();
+	
+	if (f_open(&auxFile, WAVE_SUM_FILENAME, FA_READ)) return 0;
+	if (f_read(&auxFile, &header, sizeof(header), &br) || (br != sizeof(header))
+		|| memcmp_P(header.ID, PSTR("SUM2"), 4) || (header.unit != WAVE_SUM_UNIT)) {
+		f_close(&auxFile);
+		return 0;
+	}
+	
+	waveState.verify.seg = 0;
+	waveState.verify.pages = 0;
+	waveState.verify.damaged = 0;
+	waveState.verify.bad = 0;
+	
+	if (!verify_next()) {
+		f_close(&auxFile);
+		return 0;
+	}
+	
+	verifyActive = 1;
+	return 1;
+}
+
+/**
+ * Function: wave_verify
+ * 
+ * Verifies a batch of WAVE_VERIFY_UNITS pages of the take (started by
+ * wave_verifyStart), reading the audio data into a work buffer. The size
+ * of each block of encoded data is read from its first field. Damaged
+ * time ranges are printed as they are found, then a summary at the end.
+ * Called from idle time while stopped.
+ *
+ * Parameters:
+ *    pWork - Pointer to 512 byte work buffer.
+ *
+ * Returns: Non-zero while verification is in progress.
+ */
+uint8_t wave_verify(uint8_t* pWork) {
+	if (!verifyActive) return 0;
+	
+	for (uint8_t k = 0; k < WAVE_VERIFY_UNITS; k++) {
+		WAVE_SUM_RECORD record;
+		uint16_t unit = WAVE_SUM_UNIT;
+		uint16_t fill = 0;
+		uint16_t s1 = 0;
+		uint16_t s2 = 0;
+		uint16_t br;
+		uint32_t page = waveState.verify.pages;
+		
+		// Read the data of a page (continuing into the next segment where required)
+		while (fill < unit) {
+			uint16_t n = unit - fill;
+			
+			if (!waveState.verify.remaining && !verify_next()) break;
+			if (waveState.verify.blocks && !fill) n = 2;	// Size field of block
+			if (n > 512) n = 512;
+			if (n > waveState.verify.remaining) n = waveState.verify.remaining;
+			if (f_read(&file, pWork, n, &br) || (br != n)) {
+				waveState.verify.remaining = 0;	// Unreadable, continue with next segment
+				break;
+			}
+			waveState.verify.remaining -= n;
+			
+			if (waveState.verify.blocks && !fill) {
+				unit = *(uint16_t*)pWork;
+				if ((n != 2) || (unit < CODEC_HEADER_SIZE) || (unit > CODEC_HEADER_SIZE + CODEC_BLOCK_SAMPLES - 1)) {
+					unit = n;						// Damaged size field, block chain lost
+					waveState.verify.remaining = 0;	// Continue with next segment
+				}
+			}
+			fill += n;
+			
+			for (uint16_t i = 0; i < n; i++) {
+				s1 += pWork[i];
+				s2 += s1;
+			}
+		}
+		
+		if (f_read(&auxFile, &record, sizeof(record), &br) || (br != sizeof(record))) {
+			// No checksums remain (data beyond end of take is not checked)
+			if (fill) printf_P(PSTR("No checksums beyond %lu ms\n"), page_ms(page));
+			fill = 0;
+		} else if (!fill) {
+			printf_P(PSTR("Audio data ends early: %lu ms\n"), page_ms(page));
+		}
+		
+		if (!fill) {
+			if (waveState.verify.bad) verify_report(page);
+			printf_P(PSTR("Verified %lu pages, %lu damaged\n"), waveState.verify.pages, waveState.verify.damaged);
+			verify_stop();
+			return 0;
+		}
+		
+		waveState.verify.pages++;
+		if ((record.s1 != s1) || (record.s2 != s2)) {
+			waveState.verify.damaged++;
+			if (!waveState.verify.bad) {
+				waveState.verify.bad = 1;
+				waveState.verify.badStart = page;
+			}
+		} else if (waveState.verify.bad) {
+			verify_report(page);
+		}
+	}
+	
+	return 1;
+}
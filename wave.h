@@ -14,6 +14,36 @@
 #ifndef WAVE_H_
 #define WAVE_H_
 
+// Audio formats (AudioFormat field)
+#define WAVE_FORMAT_PCM		0x0001	// Uncompressed PCM
+#define WAVE_FORMAT_DRICE	0x4452	// Lossless delta + Rice coded blocks (see codec.c), unregistered tag
+
+// State of SD card (wave_poll)
+#define WAVE_CARD_BUSY		0	// Initialisation in progress
+#define WAVE_CARD_READY		1	// Card initialised and filesystem mounted
+#define WAVE_CARD_FAILED	2	// No card, or initialisation failed
+
+#define WAVE_PREFETCH_BYTES	2048	// Data remaining in current file when next file of playlist is opened
+#define WAVE_SLOT_BYTES		163840UL	// Size of reused take file (10 s take plus trailing chunks)
+#define WAVE_FAT32_CLUSTERS	65600UL	// Minimum clusters for a FAT32 volume (wave_mkfs, with margin)
+#define WAVE_ERASE_BATCH	4		// Clusters pre-erased per call of wave_erase
+#define WAVE_RECLAIM_BATCH	8		// Clusters freed per call of wave_reclaim (one FAT sector write)
+#define WAVE_SEEK_SAMPLES	16384UL	// Initial interval of seek table entries (samples, ~1 s, whole blocks)
+#define WAVE_SEEK_ENTRIES	8		// Maximum entries of seek table (interval doubles when full)
+#define WAVE_MARKERS		9		// Maximum markers per take (cue chunk, console keys 1-9)
+#define WAVE_SEGMENT_SAMPLES	937500UL	// Maximum samples per segment of a take (60 s)
+#define WAVE_SEGMENT_BYTES	1048576UL	// Maximum audio data per segment of a take (1 MB)
+#define WAVE_SEGMENTS_MAX	99		// Maximum segments after the first (EGB24001.WAV to EGB24099.WAV)
+#define WAVE_RECOVER_PROBE	32		// Bytes read at a time when checking a sector for erasure (recovery)
+#define WAVE_RECOVER_CONFIRM	4		// Erased sectors confirming the end of PCM data (recovery)
+#define WAVE_SUM_FILENAME	"EGB240.SUM"	// Checksum sidecar filename
+#define WAVE_SUM_UNIT		512		// Samples per checksum record (buffer page)
+#define WAVE_SUM_OVERVIEW	256		// Samples per overview min/max pair
+#define WAVE_SUM_PAIRS		(WAVE_SUM_UNIT / WAVE_SUM_OVERVIEW)	// Overview pairs per record
+#define WAVE_SUM_STAGE		16		// Bytes of records staged before writing to sidecar (whole records)
+#define WAVE_VERIFY_UNITS	4		// Pages verified per call of wave_verify
+#define WAVE_CLMT_SIZE		10		// Size of cluster map of played file (fast seek, up to 4 fragments)
+
 // WAVE file header structure
 typedef struct {
 	char		ChunkID[4];	// Contains "RIFF" in ASCII
@@ -40,11 +70,80 @@ typedef union {
 	uint8_t bytes[44];
 } WAVE_HEADER;
 
-void wave_init();		// Initialise WAVE file interface
+// Seek table (body of "seek" chunk, written after the data of encoded files)
+// Entry i holds the offset (from start of data) of the block starting at
+// sample (i+1)*interval. Blocks decode independently (see codec.c), so no
+// further decoder state is required to resume at an entry.
+typedef struct {
+	uint32_t	interval;	// Samples between entries (multiple of block size)
+	uint32_t	offsets[WAVE_SEEK_ENTRIES];	// Data offsets of entries (count from chunk size)
+} WAVE_SEEK;
+
+// Header of checksum sidecar file (followed by a record per page, see wave_verifyStart)
+typedef struct {
+	char		ID[4];		// Contains "SUM2" in ASCII
+	uint16_t	unit;		// Samples per record (buffer page)
+	uint16_t	N;			// Samples per overview min/max pair
+} WAVE_SUM_HEADER;
+
+// Record of checksum sidecar file (one per page)
+typedef struct {
+	uint16_t	s1;			// Sum of bytes of audio data written for page
+	uint16_t	s2;			// Sum of s1 after each byte
+	uint8_t		pairs[2*WAVE_SUM_PAIRS];	// Overview min/max pairs (unsigned samples)
+} WAVE_SUM_RECORD;
+
+// Cue point (entry of "cue " chunk)
+typedef struct {
+	uint32_t	id;				// Cue point identifier (marker number, from 1)
+	uint32_t	position;		// Play order position (sample)
+	char		chunkID[4];		// Contains "data" in ASCII
+	uint32_t	chunkStart;		// Offset of chunk containing sample (0, data chunk)
+	uint32_t	blockStart;		// Offset of block containing sample (0)
+	uint32_t	sampleOffset;	// Sample position of cue point
+} WAVE_CUE;
+
+extern uint8_t waveCard;	// State of SD card (WAVE_CARD_*)
+extern uint8_t waveRepeat;	// Repeat mode enabled
+extern uint8_t waveReuse;	// Take file reused (preallocated) by wave_create
+extern uint8_t waveErase;	// Take file pre-erased while idle (wave_erase)
+extern uint8_t waveSegment;	// Segmented recording enabled
+
+void wave_init();		// Initialise WAVE file interface (starts SD card initialisation)
+uint8_t wave_poll();	// Continue SD card initialisation, returns WAVE_CARD_*
 void wave_create();		// Create and open new WAVE file (read/write)
 uint32_t wave_open();	// Open existing wave file (read only)
 void wave_write(uint8_t* pSamples, uint16_t count);	// Write samples to a WAVE file
-void wave_read(uint8_t* pSamples, uint16_t count);	// Read samples from WAVE file
+void wave_page(const uint8_t* pPairs);	// End of data written for a page, stages its checksum and overview
+uint16_t wave_read(uint8_t* pSamples, uint16_t count);	// Read samples from WAVE file
 void wave_close();		// Close wave file opened with wave_create or wave_open
+void wave_comment(const char* text);	// Set comment (LIST/INFO) stored when a created file is closed
+void wave_format(uint16_t format);		// Select audio format of created files (WAVE_FORMAT_*)
+void wave_channels(uint8_t channels);	// Select number of channels of created files (interleaved)
+void wave_encoded(uint16_t samples);	// Report samples represented by encoded data written
+uint16_t wave_audioFormat();			// Returns audio format of open file
+uint8_t wave_numChannels();				// Returns number of channels of open file
+void wave_reuse(uint8_t enable);		// Enable/disable reuse of preallocated take file
+void wave_preErase(uint8_t enable);	// Enable/disable pre-erase of take file while idle
+void wave_prepare();					// Discard last take, pre-erase take file for next take
+uint8_t wave_erase();					// Pre-erase a batch of clusters of the take file
+uint8_t wave_mkfs();					// Quick format SD card (aligned to allocation unit)
+void wave_layout();					// Print layout of mounted volume (cluster size, alignment)
+uint8_t wave_reclaim();					// Free a batch of clusters released by a cut take file
+void wave_repeat(uint8_t enable);		// Enable/disable repeat mode (read from start of data at end of file)
+uint32_t wave_openList();		// Open first file of playlist (all WAVE files in root directory)
+uint8_t wave_prefetch();		// Open next file of playlist in standby
+uint8_t wave_needPrefetch();	// Returns true when next file of playlist should be opened
+void wave_advance();			// Switch to next file of playlist if current file is exhausted
+uint8_t wave_listContinue();	// Returns true when playlist continues after the current file
+uint8_t wave_mark(uint32_t sample);	// Add marker to created file, returns marker number (0 where full)
+uint8_t wave_cue(uint8_t number, uint32_t* pSample);	// Get position of marker of open file, returns zero where none
+void wave_segment(uint8_t enable);		// Enable/disable segmented recording
+uint8_t wave_segmentDue();				// Returns true when the current segment is full
+uint8_t wave_rollover();				// Continue recording in next segment, returns segment number
+uint8_t wave_segmentIdle();				// Finalise previous/pre-open next segment (idle, while recording)
+uint8_t wave_verifyStart();				// Start verify of last take against its checksums, returns zero where none
+uint8_t wave_verify(uint8_t* pWork);	// Verify a batch of pages (512 byte work buffer), returns zero when complete
+uint32_t wave_seek(uint32_t sample);	// Seek open file to sample/frame (or preceding entry of seek table), returns sample reached
 
 #endif /* WAVE_H_ */
\ No newline at end of file